@@ -1,89 +1,138 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
 #include <stdint.h>
-#include <unordered_map>
-
-// Forward declaration
-template <typename T>
-class mi_tls_repository;
-
+#include <vector>
+
+/**
+ * Per instance thread local storage
+ * Each instance get a slot index at construction, each thread has a block array indexed directly by that slot
+ * (no per thread map keyed by address), and everything is freed on thread exit.
+ * The value written by the constructor is only visible in the constructing thread, other thread start from T()
+ */
 template <typename T>
-class mi_tls : protected mi_tls_repository<T> {
+class mi_tls {
       public:
-	mi_tls<T>() {
+	mi_tls()
+	    : slot(acquireSlot()), generation(nextGeneration++) {
+	}
+
+	mi_tls(const T& value)
+	    : mi_tls() {
+		get() = value;
 	}
 
-	mi_tls<T>(const T& value) {
-		this->store(reinterpret_cast<uintptr_t>(this), value);
+	//A copy is a new instance, nothing is shared (as before, the value were tied to the address)
+	mi_tls(const mi_tls<T>&)
+	    : mi_tls() {
+	}
+
+	mi_tls<T>& operator=(const mi_tls<T>&) {
+		return *this;
 	}
 
 	mi_tls<T>& operator=(const T& value) {
-		this->store(reinterpret_cast<uintptr_t>(this), value);
+		get() = value;
 		return *this;
 	}
 
 	T& get() {
-		return this->load(reinterpret_cast<uintptr_t>(this));
+		auto& e = entry();
+		return e.value;
 	}
 
 	operator T() {
-		return this->load(reinterpret_cast<uintptr_t>(this));
+		return get();
 	}
 
 	~mi_tls() {
-		this->remove(reinterpret_cast<uintptr_t>(this));
+		releaseSlot(slot);
 	}
-};
 
-template <typename T>
-class mi_tls_repository {
-      protected:
-	void store(uintptr_t instance, T value) {
-		if (!repository) { //check if the application has been already terminated, and we have an out of order destruction
-			repository = new std::unordered_map<uintptr_t, T>();
+      private:
+	struct Entry {
+		//which instance wrote this, a reused slot must not see the value of the previous owner
+		uint64_t generation = 0;
+		T        value{};
+	};
+	//Fixed size block never moved, so reference returned by get() are not invalidated when another instance grows the storage
+	static constexpr uint32_t blockSize = 64;
+	struct Storage {
+		std::vector<Entry*> blocks;
+		~Storage() {
+			for (auto block : blocks) {
+				delete[] block;
+			}
 		}
-		repository->operator[](instance) = value;
-	}
-
-	T& load(uintptr_t instance) const {
-		if (!repository) { //check if the application has been already terminated, and we have an out of order destruction
-			repository = new std::unordered_map<uintptr_t, T>();
+	};
+
+	Entry& entry() {
+		auto& s     = threadStorage();
+		auto  block = slot / blockSize;
+		if (block >= s.blocks.size()) [[unlikely]] {
+			while (s.blocks.size() <= block) {
+				s.blocks.push_back(new Entry[blockSize]);
+			}
 		}
-		return repository->operator[](instance);
+		auto& e = s.blocks[block][slot % blockSize];
+		if (e.generation != generation) [[unlikely]] {
+			e.generation = generation;
+			e.value      = T();
+		}
+		return e;
 	}
 
-	void remove(uintptr_t instance) {
-		if (!repository) { //check if the application has been already terminated, and we have an out of order destruction
-			repository = new std::unordered_map<uintptr_t, T>();
+	//plain pointer, so it is still usable if someone touch it after the thread_local destruction (static object at exit...)
+	inline static thread_local Storage* storage = nullptr;
+
+	struct Reaper {
+		~Reaper() {
+			delete storage;
+			storage = nullptr;
 		}
-		if (repository->find(instance) != repository->cend()) {
-			repository->erase(instance);
+	};
+	inline static thread_local Reaper reaper;
+
+	static Storage& threadStorage() {
+		if (!storage) [[unlikely]] {
+			storage = new Storage();
+			//odr-use, so the thread_local is constructed (and destructed on thread exit)
+			(void)&reaper;
 		}
+		return *storage;
 	}
 
-	//This will be called for all constructor
-	mi_tls_repository() {
-		//but only the first in this thread will create the map
-		if (!repository) {
-			repository = new std::unordered_map<uintptr_t, T>();
-		}
+	struct Slots {
+		std::mutex            mutex;
+		std::vector<uint32_t> free;
+		uint32_t              next = 0;
+	};
+
+	static Slots& slots() {
+		static Slots s;
+		return s;
 	}
 
-	~mi_tls_repository() {
-		//Stuff allocated by thread can not be automatically cleaned up as the destruction order can be wrong and so we loose access to the internal stuff
-		//Thus is impossible to close the inner content
+	static uint32_t acquireSlot() {
+		auto&                       s = slots();
+		std::lock_guard<std::mutex> guard(s.mutex);
+		if (!s.free.empty()) {
+			auto slot = s.free.back();
+			s.free.pop_back();
+			return slot;
+		}
+		return s.next++;
+	}
 
-		//In addition FIRST one in the thread to deallocate trigger this function, thus breaking all the other
-		
-		//So STOP wasting time to save a 10Byte memleak, and go figure a better overall logic
+	static void releaseSlot(uint32_t slot) {
+		auto&                       s = slots();
+		std::lock_guard<std::mutex> guard(s.mutex);
+		s.free.push_back(slot);
 	}
 
-      private:
-	//Key = memory location of the INSTANCE
-	//Value = what you want to store
-	//This is manual because thread_local are auto freed, but free order can be wrong (and usually __call_tls_dtors are called before the at_exit handler)! so when the DB closes (and remove the conn) we are in the wrong place
-	//Therefore this will leak memory, once you close the program, so is 100% irrelevant
+	inline static std::atomic<uint64_t> nextGeneration = 1;
 
-	//We should create another pool managed by us, but is nowhere relavant, as long as you do not create a milion thread...
-	inline static thread_local std::unordered_map<uintptr_t, T>* repository = nullptr;
+	const uint32_t slot;
+	const uint64_t generation;
 };
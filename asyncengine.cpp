@@ -0,0 +1,354 @@
+#include "asyncengine.h"
+#include "metrics.h"
+#include "mysql/mysql.h"
+#include <QDebug>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+AsyncEngine::AsyncEngine(const DBConf& _conf, uint connections)
+    : conf(_conf), slots(std::max(connections, 1u)) {
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	wakeFd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd < 0 || wakeFd < 0) {
+		throw QSL("AsyncEngine: impossible to create epoll / eventfd: %1").arg(strerror(errno));
+	}
+	epoll_event ev{};
+	ev.events = EPOLLIN;
+	//the slot index is in u32, the wake fd is marked by the max value
+	ev.data.u32 = UINT32_MAX;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+	thread = std::thread(&AsyncEngine::loop, this);
+}
+
+AsyncEngine::~AsyncEngine() {
+	stop = true;
+	uint64_t one = 1;
+	(void)!write(wakeFd, &one, sizeof(one));
+	thread.join();
+	close(wakeFd);
+	close(epollFd);
+}
+
+void AsyncEngine::submit(const QByteArray& sql, Callback callback) {
+	if (stop) {
+		throw QSL("AsyncEngine: submit after shutdown for %1").arg(QString(sql));
+	}
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		//before the push, else the worker can complete it (and decrement) first
+		pending++;
+		queue.push_back({sql, std::move(callback)});
+	}
+	uint64_t one = 1;
+	(void)!write(wakeFd, &one, sizeof(one));
+}
+
+std::future<sqlResult> AsyncEngine::submit(const QByteArray& sql) {
+	//std::function must be copyable, so the promise is shared
+	auto promise = std::make_shared<std::promise<sqlResult>>();
+	auto future  = promise->get_future();
+	submit(sql, [promise](sqlResult&& res, const QString& error) {
+		if (error.isEmpty()) {
+			promise->set_value(std::move(res));
+		} else {
+			promise->set_exception(std::make_exception_ptr(error));
+		}
+	});
+	return future;
+}
+
+std::future<sqlResult> AsyncEngine::submit(const QString& sql) {
+	return submit(sql.toUtf8());
+}
+
+uint AsyncEngine::inFlight() const {
+	return pending;
+}
+
+void AsyncEngine::loop() {
+	std::vector<epoll_event> events(slots.size() + 1);
+	while (!stop) {
+		dispatch();
+
+		auto ready = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), nextTimeout());
+		if (ready < 0 && errno != EINTR) {
+			qCritical() << "AsyncEngine: epoll_wait failed" << strerror(errno);
+			break;
+		}
+		for (int i = 0; i < ready; i++) {
+			auto& ev = events[i];
+			if (ev.data.u32 == UINT32_MAX) {
+				uint64_t count;
+				(void)!read(wakeFd, &count, sizeof(count));
+				continue;
+			}
+			auto& slot = slots[ev.data.u32];
+			if (slot.phase == Phase::Idle) {
+				//nothing is expected from an idle connection, it is the server closing it (wait_timeout...)
+				dropConnection(slot);
+				continue;
+			}
+			int status = 0;
+			if (ev.events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				status |= MYSQL_WAIT_READ;
+			}
+			if (ev.events & EPOLLOUT) {
+				status |= MYSQL_WAIT_WRITE;
+			}
+			if (ev.events & EPOLLPRI) {
+				status |= MYSQL_WAIT_EXCEPT;
+			}
+			drive(slot, status);
+		}
+
+		auto now = QDateTime::currentMSecsSinceEpoch();
+		for (auto& slot : slots) {
+			if (slot.waiting && slot.deadline && slot.deadline <= now) {
+				drive(slot, MYSQL_WAIT_TIMEOUT);
+			}
+		}
+	}
+
+	//fail whatever is left, and close everything
+	std::deque<Job> left;
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		left.swap(queue);
+	}
+	for (auto& slot : slots) {
+		if (slot.phase != Phase::Idle) {
+			finish(slot, QSL("AsyncEngine: shutdown while running %1").arg(QString(slot.job.sql)));
+		}
+		dropConnection(slot);
+	}
+	for (auto& job : left) {
+		pending--;
+		job.callback(sqlResult(), QSL("AsyncEngine: shutdown before running %1").arg(QString(job.sql)));
+	}
+}
+
+//assign the queued job to the free connection
+void AsyncEngine::dispatch() {
+	for (auto& slot : slots) {
+		if (slot.phase != Phase::Idle) {
+			continue;
+		}
+		Job job;
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			if (queue.empty()) {
+				return;
+			}
+			job = std::move(queue.front());
+			queue.pop_front();
+		}
+		begin(slot, std::move(job));
+	}
+}
+
+void AsyncEngine::begin(Slot& slot, Job&& job) {
+	slot.job = std::move(job);
+	slot.res.clear();
+	if (slot.conn) {
+		slot.phase = Phase::Query;
+	} else {
+		slot.conn  = mysqlInit(conf, slot.clientFlag);
+		slot.phase = Phase::Connect;
+		slot.setup = true;
+	}
+	drive(slot, 0);
+}
+
+//run the state machine until mysql has to wait for the socket, or the job is over
+void AsyncEngine::drive(Slot& slot, int ready) {
+	while (slot.phase != Phase::Idle) {
+		auto status = step(slot, ready);
+		if (status) {
+			slot.waiting = true;
+			watch(slot, status);
+			return;
+		}
+		slot.waiting  = false;
+		slot.deadline = 0;
+		if (!complete(slot)) {
+			return;
+		}
+	}
+}
+
+int AsyncEngine::step(Slot& slot, int ready) {
+	auto conn = slot.conn;
+	switch (slot.phase) {
+	case Phase::Connect:
+		if (slot.waiting) {
+			return mysql_real_connect_cont(&slot.connectRet, conn, ready);
+		}
+		return mysql_real_connect_start(&slot.connectRet, conn, conf.host, conf.user.constData(), conf.pass.constData(),
+		                                conf.getDefaultDB(), conf.port, conf.sock.constData(), slot.clientFlag);
+	case Phase::Query:
+		if (slot.waiting) {
+			return mysql_real_query_cont(&slot.err, conn, ready);
+		}
+		//a big query can still be read from this buffer during the _cont, so it must live until the end
+		slot.sending = slot.setup ? conf.sessionSetup() : slot.job.sql;
+		DBMetrics::queries().add();
+		DBMetrics::bytesSent().add(slot.sending.size());
+		return mysql_real_query_start(&slot.err, conn, slot.sending.constData(), static_cast<unsigned long>(slot.sending.size()));
+	case Phase::Store:
+		if (slot.waiting) {
+			return mysql_store_result_cont(&slot.result, conn, ready);
+		}
+		return mysql_store_result_start(&slot.result, conn);
+	case Phase::NextResult:
+		if (slot.waiting) {
+			return mysql_next_result_cont(&slot.err, conn, ready);
+		}
+		return mysql_next_result_start(&slot.err, conn);
+	case Phase::Idle:
+		break;
+	}
+	return 0;
+}
+
+/**
+ * @brief AsyncEngine::complete an operation is over, move to the next phase
+ * @return false if the job is over (ok or not)
+ */
+bool AsyncEngine::complete(Slot& slot) {
+	auto conn = slot.conn;
+	switch (slot.phase) {
+	case Phase::Connect:
+		if (!slot.connectRet) {
+			auto error = QSL("Mysql connection error for %1 \n Error %2").arg(conf.getInfo()).arg(mysql_error(conn));
+			finish(slot, error);
+			dropConnection(slot);
+			return false;
+		}
+		slot.phase = Phase::Query;
+		return true;
+	case Phase::Query:
+		if (slot.err) {
+			break;
+		}
+		slot.phase = Phase::Store;
+		return true;
+	case Phase::Store:
+		if (slot.result) {
+			if (!slot.setup) {
+				appendRows(slot.result, slot.res, NULL_as_EMPTY);
+			}
+			mysql_free_result(slot.result);
+			slot.result = nullptr;
+		} else if (mysql_errno(conn)) {
+			break;
+		}
+		if (!mysql_more_results(conn)) {
+			if (slot.setup) {
+				slot.setup = false;
+				slot.phase = Phase::Query;
+				return true;
+			}
+			finish(slot, QString());
+			return false;
+		}
+		slot.phase = Phase::NextResult;
+		return true;
+	case Phase::NextResult:
+		//0 = there is another result, -1 = no more (should not happen as we check mysql_more_results), >0 error
+		if (slot.err > 0) {
+			break;
+		}
+		slot.phase = Phase::Store;
+		return true;
+	case Phase::Idle:
+		return false;
+	}
+
+	//mysql error
+	auto error = mysql_errno(conn);
+	auto msg   = QSL("Mysql error for %1 \nerror was %2 code: %3").arg(QString(slot.sending)).arg(mysql_error(conn)).arg(error);
+	qWarning().noquote() << msg;
+	finish(slot, msg);
+	//after an error in a multi statement (or a lost connection) the connection state is unknown, a new one is cheaper than guessing
+	dropConnection(slot);
+	return false;
+}
+
+void AsyncEngine::finish(Slot& slot, const QString& error) {
+	auto job   = std::move(slot.job);
+	auto res   = std::move(slot.res);
+	slot.job   = Job();
+	slot.res   = sqlResult();
+	slot.phase = Phase::Idle;
+	slot.setup = false;
+	pending--;
+	if (job.callback) {
+		try {
+			job.callback(std::move(res), error);
+		} catch (...) {
+			qCritical() << "AsyncEngine: exception in the callback for" << job.sql;
+		}
+	}
+}
+
+void AsyncEngine::watch(Slot& slot, int status) {
+	epoll_event ev{};
+	ev.data.u32 = static_cast<uint32_t>(&slot - slots.data());
+	if (status & MYSQL_WAIT_READ) {
+		ev.events |= EPOLLIN;
+	}
+	if (status & MYSQL_WAIT_WRITE) {
+		ev.events |= EPOLLOUT;
+	}
+	if (status & MYSQL_WAIT_EXCEPT) {
+		ev.events |= EPOLLPRI;
+	}
+	if (status & MYSQL_WAIT_TIMEOUT) {
+		slot.deadline = QDateTime::currentMSecsSinceEpoch() + mysql_get_timeout_value_ms(slot.conn);
+	}
+
+	auto fd = mysql_get_socket(slot.conn);
+	if (slot.fd != fd) {
+		if (slot.fd >= 0) {
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, slot.fd, nullptr);
+		}
+		slot.fd = fd;
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+	} else {
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+	}
+}
+
+void AsyncEngine::dropConnection(Slot& slot) {
+	if (slot.fd >= 0) {
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, slot.fd, nullptr);
+		slot.fd = -1;
+	}
+	if (slot.result) {
+		mysql_free_result(slot.result);
+		slot.result = nullptr;
+	}
+	if (slot.conn) {
+		mysql_close(slot.conn);
+		slot.conn = nullptr;
+	}
+	slot.waiting  = false;
+	slot.deadline = 0;
+}
+
+//ms for epoll_wait, -1 if no one asked for a timeout
+int AsyncEngine::nextTimeout() const {
+	qint64 next = 0;
+	for (auto& slot : slots) {
+		if (slot.waiting && slot.deadline && (!next || slot.deadline < next)) {
+			next = slot.deadline;
+		}
+	}
+	if (!next) {
+		return -1;
+	}
+	return static_cast<int>(std::max<qint64>(0, next - QDateTime::currentMSecsSinceEpoch()));
+}
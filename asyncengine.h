@@ -0,0 +1,90 @@
+#pragma once
+
+#include "min_mysql.h"
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief The AsyncEngine class keeps many query in flight from a single thread
+ * It owns N non blocking connection (opened lazily), and drives connect / query / store_result / next_result
+ * with the mariadb _start / _cont api, waiting on all the socket with a single epoll.
+ * submit() can be called from any thread, query are dispatched FIFO on the first free connection.
+ * A callback is invoked in the engine thread, so keep it short (or use the future version)
+ */
+class AsyncEngine {
+      public:
+	//error is empty on success
+	using Callback = std::function<void(sqlResult&& res, const QString& error)>;
+
+	AsyncEngine(const DBConf& conf, uint connections = 8);
+	~AsyncEngine();
+	AsyncEngine(const AsyncEngine&) = delete;
+	AsyncEngine& operator=(const AsyncEngine&) = delete;
+
+	void submit(const QByteArray& sql, Callback callback);
+	//The future will rethrow the error as a QString
+	std::future<sqlResult> submit(const QByteArray& sql);
+	std::future<sqlResult> submit(const QString& sql);
+
+	//Submitted and not yet completed
+	uint inFlight() const;
+
+	bool NULL_as_EMPTY = false;
+
+      private:
+	struct Job {
+		QByteArray sql;
+		Callback   callback;
+	};
+
+	enum class Phase {
+		Idle,
+		Connect,
+		Query,
+		Store,
+		NextResult
+	};
+
+	struct Slot {
+		st_mysql*     conn       = nullptr;
+		int           fd         = -1;
+		Phase         phase      = Phase::Idle;
+		bool          waiting    = false; //a _start returned a wait status, next step is a _cont
+		bool          setup      = false; //running DBConf::sessionSetup before the job
+		qint64        deadline   = 0;     //ms since epoch, if mysql asked for a timeout
+		unsigned long clientFlag = 0;
+		st_mysql*     connectRet = nullptr;
+		int           err        = 0;
+		QByteArray    sending; //the statement being sent
+		st_mysql_res* result     = nullptr;
+		Job           job;
+		sqlResult     res;
+	};
+
+	void loop();
+	void dispatch();
+	void begin(Slot& slot, Job&& job);
+	void drive(Slot& slot, int ready);
+	int  step(Slot& slot, int ready);
+	bool complete(Slot& slot);
+	void finish(Slot& slot, const QString& error);
+	void watch(Slot& slot, int status);
+	void dropConnection(Slot& slot);
+	int  nextTimeout() const;
+
+	DBConf            conf;
+	std::vector<Slot> slots;
+	int               epollFd = -1;
+	int               wakeFd  = -1;
+
+	mutable std::mutex mutex;
+	std::deque<Job>    queue;
+	std::atomic<uint>  pending{0};
+	std::atomic<bool>  stop{false};
+	std::thread        thread;
+};
@@ -0,0 +1,339 @@
+#include "connpool.h"
+#include "metrics.h"
+#include "mysql/mysql.h"
+#include "preparedstatement.h"
+#include <QDateTime>
+#include <QDebug>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <thread>
+
+//I (Roy) really do not like reading warning, so we will now properly close all opened connection!
+class PoolRegistry {
+      public:
+	~PoolRegistry() {
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			stopping = true;
+		}
+		cv.notify_all();
+		if (reaper.joinable()) {
+			reaper.join();
+		}
+		std::lock_guard<std::mutex> guard(mutex);
+		alive = false;
+		//the pool themself are leaked on purpose, a thread can still be running and use them
+		for (auto& [key, pool] : pools) {
+			pool->closeIdle();
+		}
+	}
+
+	ConnPool* get(const DBConf& conf) {
+		std::lock_guard<std::mutex> guard(mutex);
+		auto&                       pool = pools[conf.poolKey()];
+		if (!pool) {
+			pool = new ConnPool(conf);
+			//the pool is never deleted, so is safe to capture
+			Metrics::Labels labels = {{"pool", QByteArray::number(static_cast<uint>(pools.size()))}, {"server", conf.user + '@' + conf.host + ':' + QByteArray::number(conf.port)}};
+			auto            p      = pool;
+			Metrics::gaugeFn("minmysql_pool_connections", "Connection open, in use or idle", [p] { return p->getTotal(); }, labels);
+			Metrics::gaugeFn("minmysql_pool_idle_connections", "Connection open and idle", [p] { return p->getIdle(); }, labels);
+			if (!reaper.joinable()) {
+				reaper = std::thread(&PoolRegistry::reapLoop, this);
+			}
+		}
+		return pool;
+	}
+
+	std::atomic<bool> alive = true;
+
+      private:
+	//a pool nobody touches would otherwise keep its idle connection open forever
+	void reapLoop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!cv.wait_for(lock, std::chrono::seconds(reapInterval), [this] { return stopping; })) {
+			std::vector<ConnPool*> list;
+			for (auto& [key, pool] : pools) {
+				list.push_back(pool);
+			}
+			lock.unlock();
+			for (auto pool : list) {
+				pool->reap();
+			}
+			lock.lock();
+		}
+	}
+
+	static constexpr uint reapInterval = 5; //seconds
+
+	std::mutex                      mutex;
+	std::condition_variable         cv;
+	bool                            stopping = false;
+	std::thread                     reaper;
+	std::map<QByteArray, ConnPool*> pools;
+};
+
+static PoolRegistry& registry() {
+	static PoolRegistry r;
+	return r;
+}
+
+/**
+ * The connection leased by this thread, one per pool and DB, usually just a few so a vector is faster than anything
+ */
+struct Lease {
+	const ConnPool*     pool;
+	const void*         owner;
+	std::weak_ptr<char> token; //expired once the DB is gone, see DB::leaseToken
+	PooledConn*         pooled;
+};
+using LeaseTable = std::vector<Lease>;
+//plain pointer, so it is still usable if someone run a query after the thread_local destruction (static DB at exit...)
+static thread_local LeaseTable* leaseTable = nullptr;
+
+//Give back the connection to the pool on thread exit
+struct LeaseReturner {
+	~LeaseReturner() {
+		if (!leaseTable) {
+			return;
+		}
+		if (registry().alive) {
+			for (auto& lease : *leaseTable) {
+				lease.pooled->pool->checkin(lease.pooled);
+			}
+		}
+		delete leaseTable;
+		leaseTable = nullptr;
+	}
+};
+static thread_local LeaseReturner leaseReturner;
+
+static LeaseTable& leases() {
+	if (!leaseTable) {
+		leaseTable = new LeaseTable();
+		//odr-use, so the thread_local is constructed (and destructed on thread exit)
+		(void)&leaseReturner;
+	}
+	return *leaseTable;
+}
+
+PooledConn::PooledConn(ConnPool* _pool)
+    : pool(_pool) {
+}
+
+PooledConn::~PooledConn() {
+	//statement must go before the connection
+	stmtCache.reset();
+	if (conn) {
+		mysql_close(conn);
+	}
+}
+
+ConnPool* ConnPool::forConf(const DBConf& conf) {
+	return registry().get(conf);
+}
+
+ConnPool::ConnPool(const DBConf& conf) {
+	maxSize      = conf.poolMaxSize;
+	minIdle      = conf.poolMinIdle;
+	idleTimeout  = conf.poolIdleTimeout;
+	waitTimeout  = conf.poolWaitTimeout;
+	validateIdle = conf.poolValidateIdle;
+	sessionSetup = conf.sessionSetup();
+}
+
+PooledConn* ConnPool::checkout() {
+	while (true) {
+		PooledConn* pooled = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			auto                         now   = QDateTime::currentMSecsSinceEpoch();
+			auto                         stale = reapLocked(now);
+			if (!stale.empty()) {
+				lock.unlock();
+				for (auto p : stale) {
+					close(p);
+				}
+				lock.lock();
+			}
+
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(waitTimeout);
+			while (idle.empty() && maxSize && total >= maxSize) {
+				waits++;
+				DBMetrics::poolWaits().add();
+				if (cv.wait_until(lock, deadline) == std::cv_status::timeout && idle.empty() && total >= maxSize) {
+					auto msg = QSL("Connection pool exhausted, %1 connection in use, waited %2 sec").arg(total).arg(waitTimeout);
+					throw DBException(msg, DBException::Error::Connection);
+				}
+			}
+			if (idle.empty()) {
+				//reserve the slot, the caller will connect
+				total++;
+				return new PooledConn(this);
+			}
+			pooled = idle.back();
+			idle.pop_back();
+		}
+
+		//validate only the one that sat idle long enough to be possibly dead, outside the lock
+		auto idleFor = QDateTime::currentMSecsSinceEpoch() - pooled->lastUse;
+		if (idleFor < static_cast<qint64>(validateIdle) * 1000 || mysql_ping(pooled->conn) == 0) {
+			return pooled;
+		}
+		qDebug() << "discarding a dead pooled mysql connection";
+		discard(pooled);
+	}
+}
+
+void ConnPool::checkin(PooledConn* pooled) {
+	if (!resetSession(pooled)) {
+		qDebug() << "discarding a pooled mysql connection that failed the session reset";
+		discard(pooled);
+		return;
+	}
+	std::vector<PooledConn*> stale;
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		pooled->lastUse = QDateTime::currentMSecsSinceEpoch();
+		idle.push_back(pooled);
+		stale = reapLocked(pooled->lastUse);
+	}
+	cv.notify_one();
+	for (auto p : stale) {
+		close(p);
+	}
+}
+
+void ConnPool::discard(PooledConn* pooled) {
+	close(pooled);
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		total--;
+	}
+	cv.notify_one();
+}
+
+void ConnPool::reap() {
+	std::vector<PooledConn*> stale;
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		stale = reapLocked(QDateTime::currentMSecsSinceEpoch());
+	}
+	for (auto p : stale) {
+		close(p);
+	}
+}
+
+uint ConnPool::getTotal() const {
+	std::lock_guard<std::mutex> guard(mutex);
+	return total;
+}
+
+uint ConnPool::getIdle() const {
+	std::lock_guard<std::mutex> guard(mutex);
+	return static_cast<uint>(idle.size());
+}
+
+uint ConnPool::getWaits() const {
+	std::lock_guard<std::mutex> guard(mutex);
+	return waits;
+}
+
+PooledConn* ConnPool::leased(const ConnPool* pool, const void* owner) {
+	//do not create the table just to find nothing (and maybe at thread exit)
+	if (!leaseTable) {
+		return nullptr;
+	}
+	for (auto& lease : *leaseTable) {
+		if (lease.pool == pool && lease.owner == owner) {
+			return lease.pooled;
+		}
+	}
+	return nullptr;
+}
+
+void ConnPool::setLease(ConnPool* pool, const std::shared_ptr<char>& owner, PooledConn* pooled) {
+	auto& table = leases();
+	//the DB destroyed in another thread can not give back what they leased here, so it is done now
+	for (auto iter = table.begin(); iter != table.end();) {
+		if (iter->token.expired()) {
+			iter->pooled->pool->checkin(iter->pooled);
+			iter = table.erase(iter);
+		} else {
+			++iter;
+		}
+	}
+	table.push_back(Lease{pool, owner.get(), owner, pooled});
+}
+
+void ConnPool::removeLease(const ConnPool* pool, const void* owner) {
+	auto& table = leases();
+	for (auto iter = table.begin(); iter != table.end(); ++iter) {
+		if (iter->pool == pool && iter->owner == owner) {
+			table.erase(iter);
+			return;
+		}
+	}
+}
+
+void ConnPool::closeIdle() {
+	std::deque<PooledConn*> toClose;
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		toClose.swap(idle);
+		total -= static_cast<uint>(toClose.size());
+	}
+	for (auto p : toClose) {
+		close(p);
+	}
+}
+
+std::vector<PooledConn*> ConnPool::reapLocked(qint64 now) {
+	std::vector<PooledConn*> stale;
+	//front is the oldest, 0 means never
+	while (idleTimeout && idle.size() > minIdle && now - idle.front()->lastUse > static_cast<qint64>(idleTimeout) * 1000) {
+		stale.push_back(idle.front());
+		idle.pop_front();
+		total--;
+	}
+	return stale;
+}
+
+/**
+ * @brief ConnPool::resetSession give back the connection as if was just opened
+ * @return false if the connection is not usable anymore
+ */
+bool ConnPool::resetSession(PooledConn* pooled) const {
+	auto conn = pooled->conn;
+	if (!conn) {
+		return false;
+	}
+	if (conn->server_status & SERVER_STATUS_IN_TRANS) {
+		if (mysql_rollback(conn)) {
+			return false;
+		}
+	}
+	//the server drops the prepared statement too
+	if (pooled->stmtCache) {
+		pooled->stmtCache->clear();
+	}
+	if (mysql_reset_connection(conn)) {
+		return false;
+	}
+	if (mysql_real_query(conn, sessionSetup.constData(), static_cast<unsigned long>(sessionSetup.size()))) {
+		return false;
+	}
+	//one result per SET
+	do {
+		if (auto res = mysql_store_result(conn); res) {
+			mysql_free_result(res);
+		}
+	} while (mysql_next_result(conn) == 0);
+	return mysql_errno(conn) == 0;
+}
+
+void ConnPool::close(PooledConn* pooled) {
+	delete pooled;
+}
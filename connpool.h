@@ -0,0 +1,91 @@
+#pragma once
+
+#include "min_mysql.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class StmtCache;
+class ConnPool;
+
+/**
+ * @brief The PooledConn struct is a connection owned by a ConnPool, plus all the per connection stuff
+ */
+struct PooledConn {
+	PooledConn(ConnPool* _pool);
+	~PooledConn();
+	ConnPool* pool = nullptr;
+	st_mysql* conn = nullptr;
+	//ms since epoch, last time it was returned to the pool
+	qint64 lastUse = 0;
+	//ms since epoch, last statement completed without error
+	qint64    lastActivity = 0;
+	ConnStats stats;
+	//prepared statement of this connection
+	std::unique_ptr<StmtCache> stmtCache;
+};
+
+/**
+ * @brief The ConnPool class is shared by all the DB with the same DBConf (see DBConf::poolKey)
+ * Each DB lease one connection per thread (its own session, as when each DB opened its own connection),
+ * and keeps it until DB::releaseConn, the DB destruction or the thread exit. A DB destroyed in another thread
+ * gives back the lease of this thread the next time this thread leases a connection.
+ * The connection are reused across DB and thread instead of being closed and opened again.
+ * On checkin the session is reset (open transaction rolled back, mysql_reset_connection, DBConf::sessionSetup replayed),
+ * so nothing (GET_LOCK, @variables, @@max_statement_time...) leaks to the next borrower.
+ * If poolMaxSize is set, a thread that needs a connection waits up to poolWaitTimeout for one to be released,
+ * so a thread that keeps a DB alive but idle should call DB::releaseConn.
+ * The idle connection are reaped every few seconds by a background thread.
+ */
+class ConnPool {
+      public:
+	static ConnPool* forConf(const DBConf& conf);
+
+	/**
+	 * @brief checkout a validated idle connection, or a new PooledConn with conn == nullptr
+	 * that the caller MUST connect (or discard if that fails)
+	 */
+	PooledConn* checkout();
+	//reset the session and put it back in the idle list, or discard it if the reset fails
+	void        checkin(PooledConn* pooled);
+	//close the connection and free the slot
+	void discard(PooledConn* pooled);
+	//close the connection idle for more than poolIdleTimeout (keeping poolMinIdle)
+	void reap();
+
+	uint getTotal() const;
+	uint getIdle() const;
+	uint getWaits() const;
+
+	//The connection leased by the current thread for owner (see DB::leaseToken), nullptr if none
+	static PooledConn* leased(const ConnPool* pool, const void* owner);
+	static void        setLease(ConnPool* pool, const std::shared_ptr<char>& owner, PooledConn* pooled);
+	static void        removeLease(const ConnPool* pool, const void* owner);
+
+      private:
+	ConnPool(const DBConf& conf);
+	void closeIdle();
+	//must be called with the lock held, return the connection to be closed
+	std::vector<PooledConn*> reapLocked(qint64 now);
+	static void              close(PooledConn* pooled);
+	bool                     resetSession(PooledConn* pooled) const;
+
+	friend class PoolRegistry;
+
+	uint maxSize      = 0;
+	uint minIdle      = 0;
+	uint idleTimeout  = 0;
+	uint waitTimeout  = 0;
+	uint validateIdle = 0;
+	//same for all the connection of the pool, as the poolKey covers what it depends on
+	QByteArray sessionSetup;
+
+	mutable std::mutex      mutex;
+	std::condition_variable cv;
+	//back is the most recently used one
+	std::deque<PooledConn*> idle;
+	uint                    total = 0;
+	uint                    waits = 0;
+};
@@ -0,0 +1,159 @@
+#include "insertbatcher.h"
+#include <QDebug>
+
+InsertBatcher::InsertBatcher(DB* _db, const QString& _table)
+    : db(_db), table(_table) {
+}
+
+InsertBatcher::~InsertBatcher() {
+	//a destructor must not throw
+	try {
+		flush();
+	} catch (const QString& e) {
+		qWarning().noquote() << "InsertBatcher for" << table << ":" << rows.size() << "row lost on destruction," << e;
+	} catch (...) {
+		qWarning().noquote() << "InsertBatcher for" << table << ":" << rows.size() << "row lost on destruction";
+	}
+}
+
+void InsertBatcher::push(const SqlComposer& row) {
+	append(row.getColumns());
+}
+
+void InsertBatcher::push(const std::vector<SScol>& row) {
+	append(row);
+}
+
+void InsertBatcher::push(const QMap<QString, QString>& row) {
+	std::vector<SScol> cols;
+	cols.reserve(static_cast<size_t>(row.size()));
+	for (auto iter = row.begin(); iter != row.end(); ++iter) {
+		cols.emplace_back(iter.key(), iter.value());
+	}
+	append(cols);
+}
+
+void InsertBatcher::setUpdateOnDuplicate(const QStringList& _columns) {
+	updateOnDuplicate = _columns;
+}
+
+void InsertBatcher::append(const std::vector<SScol>& row) {
+	if (row.empty()) {
+		return;
+	}
+	if (columns.isEmpty()) {
+		for (auto& col : row) {
+			columns.append(col.getKey());
+		}
+	}
+	if (static_cast<int>(row.size()) != columns.size()) {
+		throw QSL("InsertBatcher for %1: the row has %2 column, expected %3 (%4)").arg(table).arg(row.size()).arg(columns.size()).arg(columns.join(", "));
+	}
+
+	QString line = QSL("(");
+	for (int i = 0; i < columns.size(); i++) {
+		auto& key = columns[i];
+		//usually in the same order, so this is the first one tried
+		const SScol* found = nullptr;
+		if (row[i].getKey() == key) {
+			found = &row[i];
+		} else {
+			for (auto& col : row) {
+				if (col.getKey() == key) {
+					found = &col;
+					break;
+				}
+			}
+		}
+		if (!found) {
+			throw QSL("InsertBatcher for %1: the row is missing the column %2").arg(table, key);
+		}
+		if (i) {
+			line.append(',');
+		}
+		line.append(found->sqlValue());
+	}
+	line.append(')');
+	rows.append(line.toUtf8());
+
+	if (autoFlushRows && static_cast<uint>(rows.size()) >= autoFlushRows) {
+		flush();
+	}
+}
+
+QByteArrayList InsertBatcher::compose() {
+	auto statements = render(nullptr);
+	rows.clear();
+	return statements;
+}
+
+QByteArrayList InsertBatcher::render(std::vector<int>* rowsPerStatement) const {
+	QByteArrayList statements;
+	if (rows.isEmpty()) {
+		return statements;
+	}
+
+	QStringList quoted;
+	for (auto& col : columns) {
+		quoted.append(quoteIdentifier(col));
+	}
+	auto head = QSL("INSERT INTO %1 (%2) VALUES\n").arg(quoteIdentifier(table), quoted.join(',')).toUtf8();
+	QByteArray tail;
+	if (!updateOnDuplicate.isEmpty()) {
+		QStringList set;
+		for (auto& col : updateOnDuplicate) {
+			set.append(QSL("%1 = VALUES(%1)").arg(quoteIdentifier(col)));
+		}
+		tail = QSL("\nON DUPLICATE KEY UPDATE %1").arg(set.join(QSL(", "))).toUtf8();
+	}
+
+	auto limit = static_cast<int>(db->maxAllowedPacket() * packetFill) - 1 - head.size() - tail.size();
+
+	QByteArray sql;
+	uint       inSql = 0;
+	auto       close = [&]() {
+		sql.prepend(head);
+		sql.append(tail);
+		statements.append(sql);
+		if (rowsPerStatement) {
+			rowsPerStatement->push_back(static_cast<int>(inSql));
+		}
+		sql.clear();
+		inSql = 0;
+	};
+
+	for (auto& row : rows) {
+		if (inSql && (sql.size() + row.size() + 2 > limit || (maxRows && inSql >= maxRows))) {
+			close();
+		}
+		if (inSql) {
+			sql.append(",\n");
+		} else if (row.size() > limit) {
+			qWarning().noquote() << "InsertBatcher for" << table << ": a single row of" << row.size() << "byte is bigger than the max packet, the server will most probably refuse it";
+		}
+		sql.append(row);
+		inSql++;
+	}
+	close();
+	return statements;
+}
+
+uint InsertBatcher::flush() {
+	if (rows.isEmpty()) {
+		return 0;
+	}
+	if (db == nullptr) {
+		throw QSL("you forget to set a usable DB Conn!") + QStacker16();
+	}
+	std::vector<int> rowsPerStatement;
+	auto             statements = render(&rowsPerStatement);
+	uint             count      = 0;
+	for (int i = 0; i < statements.size(); i++) {
+		//on error only the row already written are gone, the other are still buffered for the next flush
+		db->queryDeadlockRepeater(statements[i]);
+		auto n = rowsPerStatement[static_cast<size_t>(i)];
+		rows.erase(rows.begin(), rows.begin() + n);
+		count += static_cast<uint>(n);
+	}
+	return count;
+}
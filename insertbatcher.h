@@ -0,0 +1,55 @@
+#pragma once
+
+#include "min_mysql.h"
+#include "sqlcomposer.h"
+#include <QMap>
+#include <vector>
+
+/**
+ * @brief The InsertBatcher class collapses many single row INSERT into
+ * INSERT INTO table (a,b) VALUES (...),(...),... [ON DUPLICATE KEY UPDATE a = VALUES(a)]
+ * each statement is as big as the packet limit allows (or maxRows), which is an order of magnitude faster server side.
+ * All the row must have the same set of column (in any order), the first row pushed decides it.
+ * Table and column are plain names, they are backtick quoted here.
+ */
+class InsertBatcher {
+      public:
+	InsertBatcher(DB* _db, const QString& _table);
+	//rows still in the buffer are written
+	~InsertBatcher();
+	InsertBatcher(const InsertBatcher&) = delete;
+	InsertBatcher& operator=(const InsertBatcher&) = delete;
+
+	void push(const SqlComposer& row);
+	void push(const std::vector<SScol>& row);
+	//the value are treated as string (so base64 encoded)
+	void push(const QMap<QString, QString>& row);
+
+	//ON DUPLICATE KEY UPDATE col = VALUES(col) for those column
+	void setUpdateOnDuplicate(const QStringList& columns);
+
+	//the statements for the row buffered so far (and clear the buffer), to be executed somewhere else (SQLBuffering ...)
+	QByteArrayList compose();
+	//execute the buffered row, return how many have been written
+	//if a statement fails the row not yet written stay in the buffer
+	uint flush();
+
+	//fraction of the server max_allowed_packet used by a statement
+	double packetFill = 0.9;
+	//0 = only limited by the packet size
+	uint maxRows = 0;
+	//flush once that many row are buffered, 0 = only manual / on destruction
+	uint autoFlushRows = 10000;
+
+      private:
+	void append(const std::vector<SScol>& row);
+	//the statements for the buffered row, and how many row each one contains
+	QByteArrayList render(std::vector<int>* rowsPerStatement) const;
+
+	DB*         db = nullptr;
+	QString     table;
+	QStringList columns;
+	QStringList updateOnDuplicate;
+	//each one is already rendered as (v1,v2,...) in UTF8
+	QByteArrayList rows;
+};
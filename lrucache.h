@@ -0,0 +1,179 @@
+#pragma once
+
+#include <QDateTime>
+#include <QHash>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief The ShardedLRU class is an in process LRU, with a TTL per entry and a memory budget
+ * The key space is split in shards each with its own mutex, so there is no global lock, and value are shared
+ * (std::shared_ptr<const V>) so a hit is just a refcount increment, never a copy done under the lock.
+ */
+template <typename K, typename V>
+class ShardedLRU {
+      public:
+	struct Stats {
+		quint64 hits      = 0;
+		quint64 misses    = 0;
+		quint64 evictions = 0; //for the memory budget
+		quint64 expired   = 0;
+		quint64 entries   = 0;
+		quint64 bytes     = 0;
+	};
+
+	/**
+	 * @param budget  bytes (as declared on put) for the whole cache, 0 = unlimited
+	 * @param shards rounded to a power of 2
+	 */
+	ShardedLRU(quint64 budget = 256 * 1024 * 1024, uint shards = 16)
+	    : shardList(powerOf2(shards)) {
+		setBudget(budget);
+	}
+
+	void setBudget(quint64 budget) {
+		shardBudget = budget / shardList.size();
+	}
+
+	/**
+	 * @param maxAge (seconds) entry older are a miss, 0 = only the ttl set on put
+	 * @return nullptr on miss
+	 */
+	std::shared_ptr<const V> get(const K& key, uint maxAge = 0) {
+		auto& shard = shardFor(key);
+		auto  now   = QDateTime::currentSecsSinceEpoch();
+
+		std::lock_guard<std::mutex> guard(shard.mutex);
+		auto                        iter = shard.index.find(key);
+		if (iter == shard.index.end()) {
+			misses++;
+			return nullptr;
+		}
+		auto entry = iter.value();
+		if (entry->expireAt <= now) {
+			expired++;
+			misses++;
+			eraseLocked(shard, iter);
+			return nullptr;
+		}
+		if (maxAge && now - entry->insertedAt > maxAge) {
+			//not expired for everyone, just too old for this caller
+			misses++;
+			return nullptr;
+		}
+		//move to front
+		shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+		hits++;
+		return entry->value;
+	}
+
+	/**
+	 * @param ttl  seconds
+	 * @param cost bytes accounted in the budget
+	 */
+	void put(const K& key, std::shared_ptr<const V> value, uint ttl, quint64 cost) {
+		auto& shard = shardFor(key);
+		auto  now   = QDateTime::currentSecsSinceEpoch();
+		//released outside the lock, destroying a big result is not free
+		std::vector<std::shared_ptr<const V>> dropped;
+		{
+			std::lock_guard<std::mutex> guard(shard.mutex);
+			if (auto iter = shard.index.find(key); iter != shard.index.end()) {
+				dropped.push_back(iter.value()->value);
+				eraseLocked(shard, iter);
+			}
+			if (shardBudget && cost > shardBudget) {
+				//would evict everything and still not fit
+				return;
+			}
+			shard.lru.push_front(Entry{key, std::move(value), now, now + ttl, cost});
+			shard.index.insert(key, shard.lru.begin());
+			shard.bytes += cost;
+
+			while (shardBudget && shard.bytes > shardBudget) {
+				auto& last = shard.lru.back();
+				dropped.push_back(last.value);
+				evictions++;
+				eraseLocked(shard, shard.index.find(last.key));
+			}
+		}
+	}
+
+	void remove(const K& key) {
+		auto&                       shard = shardFor(key);
+		std::lock_guard<std::mutex> guard(shard.mutex);
+		if (auto iter = shard.index.find(key); iter != shard.index.end()) {
+			eraseLocked(shard, iter);
+		}
+	}
+
+	void clear() {
+		for (auto& shard : shardList) {
+			std::lock_guard<std::mutex> guard(shard.mutex);
+			shard.lru.clear();
+			shard.index.clear();
+			shard.bytes = 0;
+		}
+	}
+
+	Stats getStats() const {
+		Stats s;
+		s.hits      = hits;
+		s.misses    = misses;
+		s.evictions = evictions;
+		s.expired   = expired;
+		for (auto& shard : shardList) {
+			std::lock_guard<std::mutex> guard(shard.mutex);
+			s.entries += static_cast<quint64>(shard.lru.size());
+			s.bytes += shard.bytes;
+		}
+		return s;
+	}
+
+      private:
+	struct Entry {
+		K                        key;
+		std::shared_ptr<const V> value;
+		qint64                   insertedAt; //seconds since epoch
+		qint64                   expireAt;
+		quint64                  cost;
+	};
+	using List = std::list<Entry>;
+
+	struct Shard {
+		mutable std::mutex                mutex;
+		List                              lru; //front is the most recently used
+		QHash<K, typename List::iterator> index;
+		quint64                           bytes = 0;
+	};
+
+	static uint powerOf2(uint n) {
+		uint p = 1;
+		while (p < n) {
+			p <<= 1;
+		}
+		return p;
+	}
+
+	Shard& shardFor(const K& key) {
+		return shardList[qHash(key) & (shardList.size() - 1)];
+	}
+
+	static void eraseLocked(Shard& shard, typename QHash<K, typename List::iterator>::iterator iter) {
+		auto entry = iter.value();
+		shard.bytes -= entry->cost;
+		shard.index.erase(iter);
+		shard.lru.erase(entry);
+	}
+
+	std::vector<Shard> shardList;
+	quint64            shardBudget = 0;
+
+	std::atomic<quint64> hits{0};
+	std::atomic<quint64> misses{0};
+	std::atomic<quint64> evictions{0};
+	std::atomic<quint64> expired{0};
+};
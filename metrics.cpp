@@ -0,0 +1,198 @@
+#include "metrics.h"
+#include <deque>
+#include <map>
+#include <mutex>
+
+namespace {
+enum class Kind {
+	counter,
+	gauge,
+	gaugeFn
+};
+
+struct Series {
+	Metrics::Labels         labels;
+	ShardedGauge            value; //a counter is a gauge that only goes up
+	std::function<double()> fn;
+};
+
+struct Family {
+	QByteArray         help;
+	Kind               kind = Kind::counter;
+	std::deque<Series> series; //deque, so the reference handed out stay valid
+};
+
+struct Registry {
+	std::mutex                   mutex;
+	std::map<QByteArray, Family> families; //sorted, so the output is stable
+	std::atomic<uint>            nextShard{0};
+};
+
+Registry& registry() {
+	static Registry r;
+	return r;
+}
+
+Series& findOrCreate(const QByteArray& name, const QByteArray& help, Kind kind, const Metrics::Labels& labels, std::function<double()> fn = nullptr) {
+	auto&                       r = registry();
+	std::lock_guard<std::mutex> guard(r.mutex);
+	auto&                       family = r.families[name];
+	if (family.series.empty()) {
+		family.help = help;
+		family.kind = kind;
+	}
+	for (auto& s : family.series) {
+		if (s.labels == labels) {
+			return s;
+		}
+	}
+	auto& s  = family.series.emplace_back();
+	s.labels = labels;
+	s.fn     = std::move(fn);
+	return s;
+}
+
+QByteArray escape(const QByteArray& v) {
+	QByteArray out = v;
+	out.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+	return out;
+}
+
+QByteArray renderLabels(const Metrics::Labels& labels) {
+	if (labels.isEmpty()) {
+		return QByteArray();
+	}
+	QByteArray out = "{";
+	for (int i = 0; i < labels.size(); i++) {
+		if (i) {
+			out.append(',');
+		}
+		out.append(labels[i].first + "=\"" + escape(labels[i].second) + '"');
+	}
+	out.append('}');
+	return out;
+}
+} // namespace
+
+qint64 ShardedCounter::value() const {
+	qint64 sum = 0;
+	for (auto& c : cells) {
+		sum += c.v.load(std::memory_order_relaxed);
+	}
+	return sum;
+}
+
+uint ShardedCounter::shard() {
+	//round robin on first use, so thread in the same pool do not collide
+	thread_local uint mine = registry().nextShard.fetch_add(1, std::memory_order_relaxed) % shards;
+	return mine;
+}
+
+ShardedCounter& Metrics::counter(const QByteArray& name, const QByteArray& help, const Labels& labels) {
+	return findOrCreate(name, help, Kind::counter, labels).value;
+}
+
+ShardedGauge& Metrics::gauge(const QByteArray& name, const QByteArray& help, const Labels& labels) {
+	return findOrCreate(name, help, Kind::gauge, labels).value;
+}
+
+void Metrics::gaugeFn(const QByteArray& name, const QByteArray& help, std::function<double()> fn, const Labels& labels) {
+	findOrCreate(name, help, Kind::gaugeFn, labels, std::move(fn));
+}
+
+QByteArray Metrics::renderPrometheus() {
+	QByteArray                  out;
+	auto&                       r = registry();
+	std::lock_guard<std::mutex> guard(r.mutex);
+	for (auto& [name, family] : r.families) {
+		out.append("# HELP " + name + ' ' + family.help + '\n');
+		out.append("# TYPE " + name + (family.kind == Kind::counter ? " counter\n" : " gauge\n"));
+		for (auto& s : family.series) {
+			out.append(name + renderLabels(s.labels) + ' ');
+			if (s.fn) {
+				out.append(QByteArray::number(s.fn(), 'g', 15));
+			} else {
+				out.append(QByteArray::number(s.value.value()));
+			}
+			out.append('\n');
+		}
+	}
+	return out;
+}
+
+namespace DBMetrics {
+ShardedCounter& queries() {
+	static auto& c = Metrics::counter("minmysql_queries_total", "Statements sent to the server");
+	return c;
+}
+
+ShardedCounter& errors(uint code) {
+	//error are rare, a lookup under lock is fine
+	return Metrics::counter("minmysql_errors_total", "Statements failed, by mysql error code", {{"code", QByteArray::number(code)}});
+}
+
+ShardedCounter& reconnects() {
+	static auto& c = Metrics::counter("minmysql_reconnects_total", "Connection found dead and opened again");
+	return c;
+}
+
+ShardedCounter& retries() {
+	static auto& c = Metrics::counter("minmysql_retries_total", "Statements sent again after a connection loss");
+	return c;
+}
+
+ShardedCounter& pings() {
+	static auto& c = Metrics::counter("minmysql_pings_total", "mysql_ping done before a statement");
+	return c;
+}
+
+ShardedCounter& pingsSkipped() {
+	static auto& c = Metrics::counter("minmysql_pings_skipped_total", "Ping skipped as the connection was used recently (DBConf::pingIdleMs)");
+	return c;
+}
+
+ShardedCounter& bytesSent() {
+	static auto& c = Metrics::counter("minmysql_sent_bytes_total", "Size of the statements sent");
+	return c;
+}
+
+ShardedCounter& bytesReceived() {
+	static auto& c = Metrics::counter("minmysql_received_bytes_total", "Size of the cells fetched");
+	return c;
+}
+
+ShardedCounter& rowsFetched() {
+	static auto& c = Metrics::counter("minmysql_rows_fetched_total", "Rows fetched");
+	return c;
+}
+
+ShardedCounter& poolWaits() {
+	static auto& c = Metrics::counter("minmysql_pool_waits_total", "Times a thread waited for a free connection");
+	return c;
+}
+
+ShardedCounter& memoryCacheHits() {
+	static auto& c = Metrics::counter("minmysql_cache_hits_total", "queryCache hits, by tier", {{"tier", "memory"}});
+	return c;
+}
+
+ShardedCounter& fileCacheHits() {
+	static auto& c = Metrics::counter("minmysql_cache_hits_total", "queryCache hits, by tier", {{"tier", "file"}});
+	return c;
+}
+
+ShardedCounter& cacheMisses() {
+	static auto& c = Metrics::counter("minmysql_cache_misses_total", "queryCache misses, the query was executed");
+	return c;
+}
+
+ShardedCounter& warnings() {
+	static auto& c = Metrics::counter("minmysql_warnings_total", "Warnings raised by the statements, fetched or not (DBConf::warningPolicy)");
+	return c;
+}
+
+ShardedGauge& busyConnections() {
+	static auto& g = Metrics::gauge("minmysql_busy_connections", "Statements running right now");
+	return g;
+}
+} // namespace DBMetrics
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <atomic>
+#include <functional>
+
+/**
+ * @brief The ShardedCounter class is a counter written by many thread without cache line ping pong:
+ * each thread add to its own shard (one cache line each), value() sums them
+ */
+class ShardedCounter {
+      public:
+	static constexpr uint shards = 32;
+
+	void add(qint64 v = 1) {
+		cells[shard()].v.fetch_add(v, std::memory_order_relaxed);
+	}
+	qint64 value() const;
+
+	static uint shard();
+
+      private:
+	struct alignas(64) Cell {
+		std::atomic<qint64> v{0};
+	};
+	Cell cells[shards];
+};
+
+/**
+ * @brief The ShardedGauge class is a ShardedCounter that can go down, a thread can decrement what another thread incremented
+ */
+class ShardedGauge : public ShardedCounter {
+      public:
+	void inc() {
+		add(1);
+	}
+	void dec() {
+		add(-1);
+	}
+};
+
+/**
+ * @brief The Metrics class is the process wide registry, rendered in the Prometheus text exposition format
+ * Resolve a metric once (keep the reference, is valid until the exit) and then just add to it.
+ */
+class Metrics {
+      public:
+	using Labels = QList<QPair<QByteArray, QByteArray>>;
+
+	static ShardedCounter& counter(const QByteArray& name, const QByteArray& help, const Labels& labels = Labels());
+	static ShardedGauge&   gauge(const QByteArray& name, const QByteArray& help, const Labels& labels = Labels());
+	//read on render, for value that are already tracked somewhere else
+	static void gaugeFn(const QByteArray& name, const QByteArray& help, std::function<double()> fn, const Labels& labels = Labels());
+
+	static QByteArray renderPrometheus();
+};
+
+/**
+ * The metrics used by the library, all prefixed minmysql_
+ */
+namespace DBMetrics {
+ShardedCounter& queries();
+ShardedCounter& errors(uint code);
+ShardedCounter& reconnects();
+ShardedCounter& retries();
+ShardedCounter& pings();
+ShardedCounter& pingsSkipped();
+ShardedCounter& bytesSent();
+ShardedCounter& bytesReceived();
+ShardedCounter& rowsFetched();
+ShardedCounter& poolWaits();
+ShardedCounter& memoryCacheHits();
+ShardedCounter& fileCacheHits();
+ShardedCounter& cacheMisses();
+ShardedCounter& warnings();
+ShardedGauge&   busyConnections();
+} // namespace DBMetrics
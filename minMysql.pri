@@ -1,16 +1,50 @@
 LIBS += -lmariadb
+#uncomment to enable the zstd codec of the cachedSQL/ files (DB::cacheCompress)
+#DEFINES += MINMYSQL_ZSTD
+#LIBS += -lzstd
 
 CONFIG += object_parallel_to_source
 
 HEADERS += \
 	$$PWD/MITLS.h \
+	$$PWD/asyncengine.h \
+	$$PWD/connpool.h \
 	$$PWD/const.h \
+    $$PWD/insertbatcher.h \
+    $$PWD/lrucache.h \
+    $$PWD/metrics.h \
     $$PWD/min_mysql.h  \
+    $$PWD/preparedstatement.h \
+    $$PWD/querystats.h \
+    $$PWD/singleflight.h \
+    $$PWD/sqlcachefile.h \
+    $$PWD/sqlcolumnar.h \
+    $$PWD/sqlcomposer.h \
+    $$PWD/sqlcoroutine.h \
+    $$PWD/sqllog.h \
+    $$PWD/sqlmapping.h \
+    $$PWD/sqlparse.h \
+    $$PWD/sqlresultview.h \
+    $$PWD/sqltrace.h \
     $$PWD/ttlcache.h \
 	$$PWD/utilityfunctions.h
     
 SOURCES += \
+    $$PWD/asyncengine.cpp \
+    $$PWD/connpool.cpp \
+    $$PWD/insertbatcher.cpp \
+    $$PWD/metrics.cpp \
     $$PWD/min_mysql.cpp \
+    $$PWD/preparedstatement.cpp \
+    $$PWD/querystats.cpp \
+    $$PWD/sqlcachefile.cpp \
+    $$PWD/sqlcolumnar.cpp \
+    $$PWD/sqlcomposer.cpp \
+    $$PWD/sqlcoroutine.cpp \
+    $$PWD/sqllog.cpp \
+    $$PWD/sqlparse.cpp \
+    $$PWD/sqlresultview.cpp \
+    $$PWD/sqltrace.cpp \
     $$PWD/ttlcache.cpp \
      \
     $$PWD/utilityfunctions.cpp
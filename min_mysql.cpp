@@ -1,41 +1,42 @@
 #include "min_mysql.h"
+#include "connpool.h"
+#include "lrucache.h"
+#include "metrics.h"
+#include "singleflight.h"
+#include "sqlcachefile.h"
+#include "querystats.h"
+#include "sqllog.h"
+#include "sqltrace.h"
+#include "sqlresultview.h"
 #include "QStacker/qstacker.h"
+#include "mysql/errmsg.h"
 #include "mysql/mysql.h"
 #include <QDataStream>
 #include <QDateTime>
 #include <QDebug>
 #include <QElapsedTimer>
 #include <QFile>
+#include <QFileInfo>
 #include <QMap>
 #include <QRegularExpression>
 #include <QScopeGuard>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <fileFunction/filefunction.h>
 #include <fileFunction/serialize.h>
 #include <memory>
 #include <mutex>
 #include <poll.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
-DB::SharedState DB::sharedState;
 using namespace std;
-//I (Roy) really do not like reading warning, so we will now properly close all opened connection!
-class ConnPooler {
-      public:
-	void                        addConnPool(st_mysql* conn);
-	void                        removeConn(st_mysql* conn);
-	void                        closeAll();
-	const map<st_mysql*, bool>& getPool() const;
-	~ConnPooler();
-
-	ulong active = 0xBADF00DBADC0FFEE;
-
-      private:
-	map<st_mysql*, bool> allConn;
-	mutex                allConnMutex;
-};
-
-static ConnPooler connPooler;
-static int        somethingHappened(MYSQL* mysql, int status);
+static int  somethingHappened(MYSQL* mysql, int status);
+static bool isReadOnly(const QByteArray& sql);
+static bool isShareable(const QByteArray& sql);
 
 QString base64this(const char* param) {
 	//no alloc o.O
@@ -76,6 +77,17 @@ QString base64Nullable(const QString& param, bool emptyAsNull) {
 	return mayBeBase64(param, emptyAsNull);
 }
 
+QString quoteIdentifier(const QString& name) {
+	QStringList parts;
+	for (auto part : name.split('.')) {
+		if (part.startsWith('`') && part.endsWith('`') && part.size() > 1) {
+			part = part.mid(1, part.size() - 2).replace(QSL("``"), QSL("`"));
+		}
+		parts.append('`' + part.replace('`', QSL("``")) + '`');
+	}
+	return parts.join('.');
+}
+
 sqlRow DB::queryLine(const char* sql) const {
 	return queryLine(QByteArray(sql));
 }
@@ -85,11 +97,12 @@ sqlRow DB::queryLine(const QString& sql) const {
 }
 
 sqlRow DB::queryLine(const QByteArray& sql) const {
-	auto res = query(sql);
-	if (res.empty()) {
+	//only the first line is copied
+	auto res = queryView(sql);
+	if (res.isEmpty()) {
 		return sqlRow();
 	}
-	return res[0];
+	return res.row(0).materialize();
 }
 
 void DB::setMaxQueryTime(uint time) const {
@@ -104,37 +117,436 @@ sqlResult DB::query(const QByteArray& sql) const {
 	if (sql.isEmpty()) {
 		return sqlResult();
 	}
+	if (conf.coalesceSelect && canCoalesce(sql)) {
+		return queryCoalesced(sql);
+	}
+	return queryDirect(sql);
+}
+
+bool DB::canCoalesce(const QByteArray& sql) const {
+	//inside a transaction we must see our own write, so never share
+	if (noFetch || !isShareable(sql) || (getConn()->server_status & SERVER_STATUS_IN_TRANS)) {
+		return false;
+	}
+	//a temporary table exists only in our session
+	auto& temporary = state.get().temporaryTables;
+	if (!temporary.isEmpty()) {
+		auto upper = sql.toUpper();
+		for (auto& table : temporary) {
+			if (upper.contains(table)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief DB::trackTemporary keep the list of the temporary table created in this session, see DB::canCoalesce
+ */
+void DB::trackTemporary(const QByteArray& sql) const {
+	static const QRegularExpression create(QSL(R"(^\s*CREATE\s+TEMPORARY\s+TABLE\s+(?:IF\s+NOT\s+EXISTS\s+)?([`\w.$]+))"), QRegularExpression::CaseInsensitiveOption);
+	static const QRegularExpression drop(QSL(R"(^\s*DROP\s+TEMPORARY\s+TABLE\s+(?:IF\s+EXISTS\s+)?([`\w.$,\s]+))"), QRegularExpression::CaseInsensitiveOption);
+	//cheap check first, this runs for every statement
+	if (sql.size() < 20 || !sql.left(64).toUpper().contains("TEMPORARY")) {
+		return;
+	}
+	auto  text      = QString::fromUtf8(sql);
+	auto& temporary = state.get().temporaryTables;
+	//only the table name, without the db and the quote
+	auto bare = [](QString name) {
+		name = name.trimmed().remove('`');
+		return name.mid(name.lastIndexOf('.') + 1).toUpper().toUtf8();
+	};
+	if (auto match = create.match(text); match.hasMatch()) {
+		temporary.insert(bare(match.captured(1)));
+	} else if (auto match = drop.match(text); match.hasMatch()) {
+		for (auto& name : match.captured(1).split(',')) {
+			temporary.remove(bare(name));
+		}
+	}
+}
+
+static SingleFlight<QByteArray, sqlResult>& singleFlight() {
+	static SingleFlight<QByteArray, sqlResult> flight;
+	return flight;
+}
+
+/**
+ * @brief normalizeSQL collapse the whitespace outside of quoted string, so the same query formatted differently is the same key
+ */
+static QByteArray normalizeSQL(const QByteArray& sql) {
+	QByteArray out;
+	out.reserve(sql.size());
+	char quote = 0;
+	bool space = false;
+	for (int i = 0; i < sql.size(); i++) {
+		char c = sql[i];
+		if (quote) {
+			out.append(c);
+			if (c == '\\' && i + 1 < sql.size()) {
+				out.append(sql[++i]);
+			} else if (c == quote) {
+				quote = 0;
+			}
+			continue;
+		}
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+			space = true;
+			continue;
+		}
+		if (space && !out.isEmpty()) {
+			out.append(' ');
+		}
+		space = false;
+		if (c == '\'' || c == '"' || c == '`') {
+			quote = c;
+		}
+		out.append(c);
+	}
+	while (out.endsWith(';')) {
+		out.chop(1);
+	}
+	return out;
+}
+
+sqlResult DB::queryCoalesced(const QByteArray& sql) const {
+	auto key = conf.poolKey() + '\0' + normalizeSQL(sql);
+	//a copy of a QList is just a refcount
+	return *singleFlight().run(key, [&] { return queryDirect(sql); });
+}
+
+quint64 DB::getCoalescedCount() {
+	return singleFlight().getCoalesced();
+}
+
+sqlResult DB::queryDirect(const QByteArray& sql) const {
+	if (sql.isEmpty()) {
+		return sqlResult();
+	}
+	SQLLogger sqlLogger(sql, conf.logError, this);
+	if (!execQuery(sql, sqlLogger)) {
+		return sqlResult();
+	}
+	if (noFetch) {
+		return sqlResult();
+	}
+	return fetchResult(&sqlLogger);
+}
+
+std::vector<sqlStatementResult> DB::queryMulti(const QByteArrayList& statements) const {
+	std::vector<sqlStatementResult> results;
+	QByteArray                      sql;
+	QByteArrayList                  sent;
+	for (auto& statement : statements) {
+		auto st = statement.trimmed();
+		while (st.endsWith(';')) {
+			st.chop(1);
+		}
+		if (st.isEmpty()) {
+			continue;
+		}
+		sql.append(st);
+		sql.append(";\n");
+		sent.append(st);
+	}
+	if (sql.isEmpty()) {
+		return results;
+	}
+
+	SQLLogger sqlLogger(sql, conf.logError, this);
+	if (!execQuery(sql, sqlLogger)) {
+		return results;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+	auto    conn = getConn();
+	SqlSpan span("store", mysql_thread_id(conn));
+	//the first statement is already executed, each mysql_next_result executes the following one
+	do {
+		sqlStatementResult st;
+		MYSQL_RES*         result = mysql_store_result(conn);
+		if (result != nullptr) {
+			sqlLogger.bytes += appendRows(result, st.rows, state.get().NULL_as_EMPTY);
+			sqlLogger.rows += static_cast<quint64>(st.rows.size());
+			mysql_free_result(result);
+		} else if (mysql_field_count(conn)) {
+			//should have returned something, error is handled below
+			break;
+		}
+		st.affectedRows = static_cast<qint64>(mysql_affected_rows(conn));
+		st.insertId     = mysql_insert_id(conn);
+		st.warningCount = mysql_warning_count(conn);
+		results.push_back(std::move(st));
+	} while (mysql_next_result(conn) == 0);
+	span.end();
+	sqlLogger.fetchTime = timer.nsecsElapsed();
+
+	if (auto error = mysql_errno(conn); error) {
+		DBMetrics::errors(error).add();
+		//the statement that failed is the one after the last collected, the following are not executed
+		auto failed = results.size() < static_cast<size_t>(sent.size()) ? sent.at(static_cast<int>(results.size())) : sql;
+		auto err    = QSL("Mysql error in queryMulti for statement %1 (%2) \nerror was %3 code: %4")
+		               .arg(results.size())
+		               .arg(QString(failed))
+		               .arg(mysql_error(conn))
+		               .arg(error);
+		sqlLogger.error = err;
+		qWarning().noquote() << err << QStacker16();
+		cxaNoStack = true;
+		throw err;
+	}
+
+	afterFetch(conn, &sqlLogger);
+	return results;
+}
+
+namespace {
+/**
+ * The state of a loadData, mysql pull the data with infileRead
+ * rows are converted to TSV one at a time, and only what does not fit in the mysql buffer is kept
+ */
+struct InfileStream {
+	const RowGenerator* generator = nullptr;
+	QByteArrayList      row;
+	QByteArray          pending;
+	int                 offset = 0;
+	bool                over   = false;
+	std::exception_ptr  error;
+
+	//LOAD DATA default: FIELDS TERMINATED BY '\t' ESCAPED BY '\\' LINES TERMINATED BY '\n'
+	void encode() {
+		pending.clear();
+		offset = 0;
+		for (int i = 0; i < row.size(); i++) {
+			if (i) {
+				pending.append('\t');
+			}
+			auto& cell = row[i];
+			if (cell.isNull()) {
+				pending.append("\\N");
+				continue;
+			}
+			for (char c : cell) {
+				switch (c) {
+				case '\\':
+					pending.append("\\\\");
+					break;
+				case '\t':
+					pending.append("\\t");
+					break;
+				case '\n':
+					pending.append("\\n");
+					break;
+				case '\r':
+					pending.append("\\r");
+					break;
+				case '\0':
+					pending.append("\\0");
+					break;
+				default:
+					pending.append(c);
+				}
+			}
+		}
+		pending.append('\n');
+	}
+};
+
+int infileInit(void** ptr, const char*, void* userdata) {
+	*ptr = userdata;
+	return 0;
+}
+
+int infileRead(void* ptr, char* buf, unsigned int bufLen) {
+	auto stream  = static_cast<InfileStream*>(ptr);
+	uint written = 0;
+	while (written < bufLen) {
+		if (stream->offset == stream->pending.size()) {
+			if (stream->over) {
+				break;
+			}
+			try {
+				stream->row.clear();
+				if (!(*stream->generator)(stream->row)) {
+					stream->over = true;
+					break;
+				}
+			} catch (...) {
+				stream->error = std::current_exception();
+				return -1;
+			}
+			stream->encode();
+		}
+		auto chunk = std::min<uint>(bufLen - written, static_cast<uint>(stream->pending.size() - stream->offset));
+		memcpy(buf + written, stream->pending.constData() + stream->offset, chunk);
+		written += chunk;
+		stream->offset += static_cast<int>(chunk);
+	}
+	return static_cast<int>(written);
+}
+
+void infileEnd(void*) {
+}
+
+int infileError(void*, char* msg, unsigned int len) {
+	snprintf(msg, len, "row generator failed");
+	return CR_UNKNOWN_ERROR;
+}
+} // namespace
+
+LoadDataResult DB::loadData(const QString& table, const QStringList& columns, const RowGenerator& generator, LoadDataMode mode) const {
+	if (!conf.allowLocalInfile) {
+		throw QSL("loadData requires DBConf::allowLocalInfile") + QStacker16();
+	}
+	QString modifier;
+	switch (mode) {
+	case LoadDataMode::Plain:
+		break;
+	case LoadDataMode::Replace:
+		modifier = QSL("REPLACE ");
+		break;
+	case LoadDataMode::Ignore:
+		modifier = QSL("IGNORE ");
+		break;
+	}
+	//the file name is not used, the data come from the handler
+	QStringList quoted;
+	for (auto& column : columns) {
+		quoted.append(quoteIdentifier(column));
+	}
+	auto sql = QSL("LOAD DATA LOCAL INFILE 'minMysqlStream' %1INTO TABLE %2 CHARACTER SET utf8mb4 (%3)")
+	               .arg(modifier, quoteIdentifier(table), quoted.join(','))
+	               .toUtf8();
+
+	InfileStream stream;
+	stream.generator = &generator;
+
+	SQLLogger sqlLogger(sql, conf.logError, this);
+	auto      conn = getConn();
+	pingCheck(conn, sqlLogger);
+	mysql_set_local_infile_handler(conn, infileInit, infileRead, infileEnd, infileError, &stream);
+	auto reset = qScopeGuard([&] { mysql_set_local_infile_default(conn); });
+
+	//no fetch, and the warnings are returned instead of being logged by afterFetch
+	lastSQL = sql;
+	QElapsedTimer timer;
+	timer.start();
+	DBMetrics::busyConnections().inc();
+	mysql_real_query(conn, sql.constData(), static_cast<unsigned long>(sql.size()));
+	DBMetrics::busyConnections().dec();
+	state.get().queryExecuted++;
+	DBMetrics::queries().add();
+	DBMetrics::bytesSent().add(sql.size());
+	sqlLogger.serverTime = timer.nsecsElapsed();
+
+	if (stream.error) {
+		std::rethrow_exception(stream.error);
+	}
+	if (auto error = mysql_errno(conn); error) {
+		DBMetrics::errors(error).add();
+		auto err        = QSL("Mysql error for %1 \nerror was %2 code: %3").arg(QString(sql)).arg(mysql_error(conn)).arg(error);
+		sqlLogger.error = err;
+		qWarning().noquote() << err << QStacker16();
+		if (error == 2006 || error == 2013) {
+			closeConn();
+		}
+		cxaNoStack = true;
+		throw err;
+	}
+
+	LoadDataResult result;
+	result.rows  = mysql_affected_rows(conn);
+	affectedRows = static_cast<long>(result.rows);
+	//Records: 3  Deleted: 0  Skipped: 0  Warnings: 0
+	if (auto info = mysql_info(conn); info) {
+		static const QRegularExpression reg(QSL(R"(Skipped:\s*(\d+))"));
+		if (auto match = reg.match(QString(info)); match.hasMatch()) {
+			result.skipped = match.captured(1).toULongLong();
+		}
+	}
+	if (auto pooled = ConnPool::leased(pool, leaseToken.get()); pooled) {
+		pooled->lastActivity = QDateTime::currentMSecsSinceEpoch();
+	}
+	if (auto count = mysql_warning_count(conn); count && wantWarnings(sql, count)) {
+		result.warnings = getWarning(true);
+	}
+	return result;
+}
+
+std::vector<sqlStatementResult> DB::queryMulti(const QStringList& statements) const {
+	QByteArrayList list;
+	list.reserve(statements.size());
+	for (auto& statement : statements) {
+		list.append(statement.toUtf8());
+	}
+	return queryMulti(list);
+}
+
+bool DB::execQuery(const QByteArray& sql, SQLLogger& sqlLogger) const {
 	auto conn = getConn();
 	if (conn == nullptr) {
 		throw QSL("This mysql instance is not connected! \n") + QStacker16();
 	}
 
-	SQLLogger sqlLogger(sql, conf.logError, this);
 	if (sql != "SHOW WARNINGS") {
 		lastSQL          = sql;
 		sqlLogger.logSql = conf.logSql;
+		sqlLogger.stats  = conf.queryStats;
 	} else {
 		sqlLogger.logSql = false;
 	}
 
 	pingCheck(conn, sqlLogger);
 
-	{
+	//if the connection is lost, a statement can be sent again only if we are sure nothing is lost
+	//2006 = the query was never sent, 2013 = we do not know if was executed, so only if is read only
+	bool inTrx    = conn->server_status & SERVER_STATUS_IN_TRANS;
+	bool readOnly = isReadOnly(sql);
+	for (uint attempt = 0;; attempt++) {
 		QElapsedTimer timer;
 		timer.start();
 
-		sharedState.busyConnection++;
-		mysql_query(conn, sql.constData());
-		sharedState.busyConnection--;
+		DBMetrics::busyConnections().inc();
+		{
+			SqlSpan send("send", mysql_thread_id(conn));
+			send.setDetail(sql);
+			mysql_send_query(conn, sql.constData(), static_cast<unsigned long>(sql.size()));
+		}
+		if (!mysql_errno(conn)) {
+			SqlSpan wait("wait", mysql_thread_id(conn));
+			mysql_read_query_result(conn);
+		}
+		DBMetrics::busyConnections().dec();
 		state.get().queryExecuted++;
+		DBMetrics::queries().add();
+		DBMetrics::bytesSent().add(sql.size());
 		sqlLogger.serverTime = timer.nsecsElapsed();
+
+		auto error = mysql_errno(conn);
+		if (attempt == 0 && !inTrx && (error == 2006 || (error == 2013 && readOnly))) {
+			qDebug().noquote() << "mysql connection lost (" << error << "), reconnecting and sending again" << sql.left(256);
+			SqlSpan reconnect("reconnect");
+			closeConn();
+			conn = getConn();
+			reconnect.setConn(mysql_thread_id(conn));
+			ConnPool::leased(pool, leaseToken.get())->stats.retryDone++;
+			DBMetrics::retries().add();
+			continue;
+		}
+		if (!error) {
+			ConnPool::leased(pool, leaseToken.get())->lastActivity = QDateTime::currentMSecsSinceEpoch();
+		}
+		break;
 	}
 	if (auto error = mysql_errno(conn); error) {
+		DBMetrics::errors(error).add();
 		switch (error) {
 		case 1065:
 			//well an empty query is bad, but not too much!
 			qWarning().noquote() << "empty query (or equivalent for) " << sql << "in" << QStacker16();
-			return sqlResult();
+			return false;
 
 		case 2013: { //conn lost
 			//This is sometimes happening, and I really have no idea how to fix, there is already the ping at the beginning, but looks like is not working...
@@ -149,8 +561,8 @@ sqlResult DB::query(const QByteArray& sql) const {
 			               .arg(mysql_thread_id(conn))
 			               .arg(state.get().queryExecuted)
 			               .arg(state.get().reconnection)
-			               .arg(sharedState.busyConnection)
-			               .arg(connPooler.getPool().size())
+			               .arg(DBMetrics::busyConnections().value())
+			               .arg(pool->getTotal())
 			               .arg((double)sqlLogger.serverTime, 0, 'G', 3)
 			               .arg(sqlLogger.serverTime);
 			sqlLogger.error = err;
@@ -175,10 +587,8 @@ sqlResult DB::query(const QByteArray& sql) const {
 		}
 	}
 
-	if (noFetch) {
-		return sqlResult();
-	}
-	return fetchResult(&sqlLogger);
+	trackTemporary(sql);
+	return true;
 }
 
 sqlResult DB::queryCache(const QString& sql, bool on, QString name, uint ttl) {
@@ -212,32 +622,91 @@ sqlRow DB::queryCacheLine(const QString& sql, uint ttl, bool required) {
 	return queryCacheLine2(sql, ttl, required);
 }
 
-sqlResult DB::queryCache2(const QString& sql, uint ttl) {
-	if (ttl) {
-		//small trick to avoid calling over and over the function
-		static bool fraud = mkdir("cachedSQL");
-		(void)fraud;
+static QString cacheFileName(const QString& sql) {
+	//small trick to avoid calling over and over the function
+	static bool fraud = mkdir("cachedSQL");
+	(void)fraud;
+	return "cachedSQL/" + sha1(sql) + ".mmc";
+}
+
+static void storeCacheFile(const QString& name, const sqlResult& res) {
+	//atomic rename, so no lock is needed, a reader sees the old or the new file
+	sqlMappedResult::write(name, res, DB::cacheCompress);
 
-		QString                      name = "cachedSQL/" + sha1(sql);
-		static std::mutex            lock;
-		std::scoped_lock<std::mutex> scoped(lock);
+	static std::atomic<qint64> lastMaintain = 0;
+	auto                       now          = QDateTime::currentSecsSinceEpoch();
+	auto                       last         = lastMaintain.load();
+	if (now - last > 300 && lastMaintain.compare_exchange_strong(last, now)) {
+		sqlMappedResult::maintain(QSL("cachedSQL"), DB::cacheDirMaxBytes, DB::cacheDirMaxAge);
+	}
+}
 
-		sqlResult res;
+sqlResult DB::queryCache2(const QString& sql, uint ttl) {
+	if (ttl) {
+		//the L1 is shared across DB, so the conf is part of the key
+		auto  key = conf.poolKey() + '\0' + sql.toUtf8();
+		auto& l1  = queryCacheL1();
+		if (auto hit = l1.get(key, ttl); hit) {
+			DBMetrics::memoryCacheHits().add();
+			return *hit;
+		}
 
-		if (auto file = fileUnSerialize(name, res, ttl); file.valid) {
-			return res;
+		auto name = cacheFileName(sql);
+		if (auto mapped = sqlMappedResult::open(name); mapped) {
+			auto age = QDateTime::currentSecsSinceEpoch() - mapped->getCreatedAt();
+			if (age < ttl) {
+				DBMetrics::fileCacheHits().add();
+				auto res = mapped->toSqlResult();
+				//only for what is left of the file life
+				l1.put(key, std::make_shared<const sqlResult>(res), ttl - static_cast<uint>(std::max<qint64>(age, 0)), sqlResultCost(res));
+				return res;
+			}
 		}
 
-		lock.unlock();
-		res = query(sql);
-		lock.lock();
-		fileSerialize(name, res);
+		//on expiration all the thread arrives here together, only one goes to the server (if the result can be shared at all)
+		DBMetrics::cacheMisses().add();
+		auto utf8 = sql.toUtf8();
+		auto res  = canCoalesce(utf8) ? queryCoalesced(utf8) : queryDirect(utf8);
+		storeCacheFile(name, res);
+		l1.put(key, std::make_shared<const sqlResult>(res), ttl, sqlResultCost(res));
 		return res;
 	} else {
 		return query(sql);
 	}
 }
 
+std::shared_ptr<const sqlMappedResult> DB::queryCacheMapped(const QString& sql, uint ttl) {
+	auto name = cacheFileName(sql);
+	if (auto mapped = sqlMappedResult::open(name); mapped) {
+		if (QDateTime::currentSecsSinceEpoch() - mapped->getCreatedAt() < ttl) {
+			return mapped;
+		}
+	}
+	auto utf8 = sql.toUtf8();
+	storeCacheFile(name, canCoalesce(utf8) ? queryCoalesced(utf8) : queryDirect(utf8));
+	if (auto mapped = sqlMappedResult::open(name); mapped) {
+		return mapped;
+	}
+	throw QSL("impossible to write the cached result %1 for %2").arg(name, sql) + QStacker16();
+}
+
+quint64 sqlResultCost(const sqlResult& res) {
+	quint64 cost = sizeof(sqlResult);
+	for (auto& row : res) {
+		//QMap node overhead
+		cost += sizeof(sqlRow) + static_cast<quint64>(row.size()) * 64;
+		for (auto iter = row.begin(); iter != row.end(); ++iter) {
+			cost += static_cast<quint64>(iter.key().size() + iter.value().size());
+		}
+	}
+	return cost;
+}
+
+ShardedLRU<QByteArray, sqlResult>& DB::queryCacheL1() {
+	static ShardedLRU<QByteArray, sqlResult> cache;
+	return cache;
+}
+
 sqlResult DB::queryDeadlockRepeater(const QByteArray& sql, uint maxTry) const {
 	sqlResult result;
 	if (!sql.isEmpty()) {
@@ -271,6 +740,7 @@ void DB::pingCheck(st_mysql*& conn, SQLLogger& sqlLogger) const {
 		auto newConnId = mysql_thread_id(conn);
 		if (oldConnId != newConnId) {
 			state.get().reconnection++;
+			DBMetrics::reconnects().add();
 			qDebug() << "detected mysql reconnection";
 		}
 	});
@@ -278,14 +748,28 @@ void DB::pingCheck(st_mysql*& conn, SQLLogger& sqlLogger) const {
 	if (!conf.pingBeforeQuery) {
 		return;
 	}
+	//A connection used a moment ago is almost surely alive, just send the query, execQuery will retry if it was not
+	if (auto pooled = ConnPool::leased(pool, leaseToken.get()); pooled && conf.pingIdleMs) {
+		if (QDateTime::currentMSecsSinceEpoch() - pooled->lastActivity < conf.pingIdleMs) {
+			pooled->stats.pingSkipped++;
+			DBMetrics::pingsSkipped().add();
+			return;
+		}
+	}
 	int connRetry = 0;
 	//Those will not emit an error, only the last one
 	for (; connRetry < 5; connRetry++) {
+		auto    pooled = ConnPool::leased(pool, leaseToken.get());
+		SqlSpan span("ping", mysql_thread_id(conn));
+		span.setDetail(QByteArray::number(connRetry));
+		pooled->stats.pingDone++;
+		DBMetrics::pings().add();
 		if (mysql_ping(conn)) { //1 on error, which should not even happen ... but here we are
 			//force reconnection
 			closeConn();
 			conn = getConn();
 		} else {
+			pooled->lastActivity = QDateTime::currentMSecsSinceEpoch();
 			return;
 		}
 	}
@@ -324,12 +808,13 @@ QString QV(const sqlRow& line, const QByteArray& b) {
 }
 
 st_mysql* DB::getConn() const {
-	st_mysql* curConn = connPool;
-	if (curConn == nullptr) {
-		//loading in connPool is inside
-		curConn = connect();
+	if (pool) {
+		if (auto pooled = ConnPool::leased(pool, leaseToken.get()); pooled) {
+			return pooled->conn;
+		}
 	}
-	return curConn;
+	//leasing is inside
+	return connect();
 }
 
 ulong DB::lastId() const {
@@ -344,18 +829,96 @@ const DBConf DB::getConf() const {
 	return conf;
 }
 
+/**
+ * @brief inlineOptions the pattern with its options as an inline group, so it can be joined with the others
+ * @return empty if an option has no inline equivalent
+ */
+static QString inlineOptions(const QRegularExpression& rx) {
+	auto    options = rx.patternOptions();
+	QString flags;
+	if (options & QRegularExpression::CaseInsensitiveOption) {
+		flags += 'i';
+		options.setFlag(QRegularExpression::CaseInsensitiveOption, false);
+	}
+	if (options & QRegularExpression::DotMatchesEverythingOption) {
+		flags += 's';
+		options.setFlag(QRegularExpression::DotMatchesEverythingOption, false);
+	}
+	if (options & QRegularExpression::MultilineOption) {
+		flags += 'm';
+		options.setFlag(QRegularExpression::MultilineOption, false);
+	}
+	if (options & QRegularExpression::ExtendedPatternSyntaxOption) {
+		flags += 'x';
+		options.setFlag(QRegularExpression::ExtendedPatternSyntaxOption, false);
+	}
+	if (options != QRegularExpression::NoPatternOption) {
+		return QString();
+	}
+	if (flags.contains('x')) {
+		//a trailing comment would swallow the closing parenthesis
+		return QSL("(?%1:%2\n)").arg(flags, rx.pattern());
+	}
+	return QSL("(?%1:%2)").arg(flags, rx.pattern());
+}
+
 void DB::setConf(const DBConf& value) {
 	conf    = value;
 	confSet = true;
+	pool    = ConnPool::forConf(conf);
+
+	//one pass over the message instead of one per regex, if they can be joined without changing what they match
+	warningSuppressors.clear();
+	QStringList patterns;
+	bool        joinable = true;
 	for (auto& rx : conf.warningSuppression) {
-		rx.optimize();
+		auto pattern = inlineOptions(rx);
+		//joining renumbers the capture group
+		static const QRegularExpression backref(QSL(R"(\\(?:[1-9]|g|k)|\(\?P=)"));
+		if (pattern.isEmpty() || rx.pattern().contains(backref)) {
+			joinable = false;
+			break;
+		}
+		patterns.append(pattern);
+	}
+	if (joinable && !patterns.isEmpty()) {
+		QRegularExpression joined(patterns.join('|'));
+		if (joined.isValid()) {
+			joined.optimize();
+			warningSuppressors.append(joined);
+			return;
+		}
 	}
+	warningSuppressors = conf.warningSuppression;
 }
 
 long DB::getAffectedRows() const {
 	return affectedRows;
 }
 
+uint DB::maxAllowedPacket() const {
+	if (!maxPacket) {
+		//Is the same for all the connection, a race will just read it twice
+		auto line = queryLine(QBL("SELECT @@max_allowed_packet AS v"));
+		maxPacket = line.get2<uint>(QBL("v"));
+	}
+	return maxPacket;
+}
+
+ConnStats DB::getConnStats() const {
+	if (auto pooled = ConnPool::leased(pool, leaseToken.get()); pooled) {
+		return pooled->stats;
+	}
+	return ConnStats();
+}
+
+ulong DB::threadId() const {
+	if (auto pooled = ConnPool::leased(pool, leaseToken.get()); pooled && pooled->conn) {
+		return mysql_thread_id(pooled->conn);
+	}
+	return 0;
+}
+
 DBConf::DBConf() {
 }
 
@@ -373,6 +936,20 @@ void DBConf::setDefaultDB(const QByteArray& value) {
 	defaultDB = value;
 }
 
+QByteArray DBConf::poolKey() const {
+	//everything that changes the server side session, or how the connection is opened (LOCAL INFILE)
+	return host + ':' + QByteArray::number(port) + '|' + sock + '|' + user + '|' + pass + '|' + defaultDB +
+	       '|' + QByteArray::number(ssl) + QByteArray::number(writeBinlog) + QByteArray::number(allowLocalInfile);
+}
+
+QByteArray DBConf::sessionSetup() const {
+	QByteArray sql = "SET @@SQL_MODE = 'STRICT_TRANS_TABLES,NO_AUTO_CREATE_USER,NO_ENGINE_SUBSTITUTION'; SET time_zone='UTC';";
+	if (!writeBinlog) {
+		sql.append(" SET sql_log_bin = 0;");
+	}
+	return sql;
+}
+
 QString DBConf::getInfo(bool passwd) const {
 	auto msg = QSL(" %1:%2  user: %3")
 	               .arg(QString(host))
@@ -389,77 +966,70 @@ DB::DB(const DBConf& _conf) {
 }
 
 DB::~DB() {
-	//will be later removed by the connPooler
-	closeConn();
+	//The connection of this thread goes back to the pool (an open transaction is rolled back there),
+	//the one leased in other thread are given back by them, see ConnPool::setLease
+	releaseConn();
 }
 
 /**
- * @brief DB::closeConn should be called if you know the db instance is been used in a thread (and ofc will not be used anymore)
- * is not a problem if not done, it will just leave a few warn in the error log likeF
- * [Warning] Aborted connection XXX to db: 'ZYX' user: '123' host: 'something' (Got an error reading communication packets)
+ * @brief DB::closeConn close the connection leased by this thread, use it if you think the connection is broken
+ * Use releaseConn if you just do not need it anymore
  */
 void DB::closeConn() const {
-	st_mysql* curConn = connPool;
-	if (curConn) {
-		//this whole conn pool architecture is wrong, ditch it and recreate something and do not realy on magic constant
-		//to detect if something is freed or not
-		if (connPooler.active == 0xBADF00DBADC0FFEE) {
-			connPooler.removeConn(curConn);
-			mysql_close(curConn);
-		}
-		connPool = nullptr;
+	if (!pool) {
+		return;
+	}
+	if (auto pooled = ConnPool::leased(pool, leaseToken.get()); pooled) {
+		ConnPool::removeLease(pool, leaseToken.get());
+		pool->discard(pooled);
+	}
+}
+
+/**
+ * @brief DB::releaseConn should be called if you know the db instance is been used in a thread (and ofc will not be used for a while)
+ * The connection will be reused by another thread, if not done it will be given back once the thread exit
+ */
+void DB::releaseConn() const {
+	if (!pool) {
+		return;
+	}
+	if (auto pooled = ConnPool::leased(pool, leaseToken.get()); pooled) {
+		ConnPool::removeLease(pool, leaseToken.get());
+		pool->checkin(pooled);
 	}
 }
 
 st_mysql* DB::connect() const {
+	//just to check we have the conf set
+	getConf();
+	//a new connection is requested, so the current one (if any) is gone
+	closeConn();
+	//and a new (or reset) session has none
+	state.get().temporaryTables.clear();
+
+	SqlSpan span("connect");
+	SqlSpan checkout("connect.checkout");
+	auto    pooled = pool->checkout();
+	checkout.end();
+	if (pooled->conn) {
+		//already connected and validated
+		ConnPool::setLease(pool, leaseToken, pooled);
+		return pooled->conn;
+	}
+
 	//Mysql connection stuff is not thread safe!
 	{
 		static std::mutex           mutex;
 		std::lock_guard<std::mutex> lock(mutex);
-		st_mysql*                   conn = mysql_init(nullptr);
-
-		my_bool trueNonSense = 1;
-		//looks like is not working very well
-		mysql_options(conn, MYSQL_OPT_RECONNECT, &trueNonSense);
-		//This will enable non blocking capability
-		mysql_options(conn, MYSQL_OPT_NONBLOCK, 0);
-		//sensibly speed things up
-		mysql_options(conn, MYSQL_OPT_COMPRESS, &trueNonSense);
-		//just spam every where to be sure is used
-		mysql_options(conn, MYSQL_SET_CHARSET_NAME, "utf8mb4");
-
-		my_bool falseNonSense = 0;
-
-		mysql_options(conn, MYSQL_OPT_SSL_VERIFY_SERVER_CERT, &falseNonSense);
-
-		//Default timeout during connection and operation is Infinite o.O
-		//In a real worild if after 5 sec we still have no conn, is clearly an error!
-		/*
-		uint oldTimeout, readTimeout, writeTimeout;
-		mysql_get_option(conn, MYSQL_OPT_CONNECT_TIMEOUT, &oldTimeout);
-		mysql_get_option(conn, MYSQL_OPT_READ_TIMEOUT, &readTimeout);
-		mysql_get_option(conn, MYSQL_OPT_WRITE_TIMEOUT, &writeTimeout);
-		*/
-
-		uint timeout = 10;
-		mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
-		//Else during long query you will have error 2013
-		//mysql_options(conn, MYSQL_OPT_READ_TIMEOUT, &timeout);
-		mysql_options(conn, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
-
-		//just to check we have the conf set
-		getConf();
-
-		auto flag = CLIENT_MULTI_STATEMENTS;
-		if (conf.ssl) {
-			mysql_options(conn, MYSQL_OPT_SSL_ENFORCE, &trueNonSense);
-			flag |= CLIENT_SSL;
-		}
+		unsigned long               flag = 0;
+		st_mysql*                   conn = mysqlInit(conf, flag);
 
 		//For some reason mysql is now complaining of not having a DB selected... just select one and gg
-		auto connected = mysql_real_connect(conn, conf.host, conf.user.constData(), conf.pass.constData(),
-		                                    conf.getDefaultDB(),
-		                                    conf.port, conf.sock.constData(), flag);
+		SqlSpan handshake("connect.handshake");
+		auto    connected = mysql_real_connect(conn, conf.host, conf.user.constData(), conf.pass.constData(),
+		                                       conf.getDefaultDB(),
+		                                       conf.port, conf.sock.constData(), flag);
+		handshake.end();
 		if (connected == nullptr) {
 			//Whoever conceived those api need to search for help -.-
 			QString                         error = mysql_error(conn);
@@ -477,23 +1047,77 @@ st_mysql* DB::connect() const {
 			          .arg(error);
 
 			mysql_close(conn);
+			//free the slot in the pool
+			pool->discard(pooled);
 			messanger(msg, conf.connErrorVerbosity);
 			throw DBException(msg, DBException::Error::Connection);
 		}
 
 		/***/
-		connPool = conn;
-		connPooler.addConnPool(conn);
+		pooled->conn         = conn;
+		pooled->lastActivity = QDateTime::currentMSecsSinceEpoch();
+		ConnPool::setLease(pool, leaseToken, pooled);
 		/***/
 	}
 
-	query(QBL("SET @@SQL_MODE = 'STRICT_TRANS_TABLES,NO_AUTO_CREATE_USER,NO_ENGINE_SUBSTITUTION';"));
-	query(QBL("SET time_zone='UTC'"));
-	if (!conf.writeBinlog) {
-		query(QBL("SET sql_log_bin = 0"));
+	span.setConn(mysql_thread_id(pooled->conn));
+	{
+		SqlSpan session("connect.session", mysql_thread_id(pooled->conn));
+		query(conf.sessionSetup());
 	}
 
-	return connPool;
+	return pooled->conn;
+}
+
+st_mysql* mysqlInit(const DBConf& conf, unsigned long& clientFlag) {
+	//mysql_init is not thread safe the first time (it calls mysql_library_init)
+	static std::mutex mutex;
+	st_mysql*         conn;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		conn = mysql_init(nullptr);
+	}
+
+	my_bool trueNonSense = 1;
+	//looks like is not working very well
+	mysql_options(conn, MYSQL_OPT_RECONNECT, &trueNonSense);
+	//This will enable non blocking capability
+	mysql_options(conn, MYSQL_OPT_NONBLOCK, 0);
+	//sensibly speed things up
+	mysql_options(conn, MYSQL_OPT_COMPRESS, &trueNonSense);
+	//just spam every where to be sure is used
+	mysql_options(conn, MYSQL_SET_CHARSET_NAME, "utf8mb4");
+
+	my_bool falseNonSense = 0;
+
+	mysql_options(conn, MYSQL_OPT_SSL_VERIFY_SERVER_CERT, &falseNonSense);
+
+	//Default timeout during connection and operation is Infinite o.O
+	//In a real worild if after 5 sec we still have no conn, is clearly an error!
+	/*
+	uint oldTimeout, readTimeout, writeTimeout;
+	mysql_get_option(conn, MYSQL_OPT_CONNECT_TIMEOUT, &oldTimeout);
+	mysql_get_option(conn, MYSQL_OPT_READ_TIMEOUT, &readTimeout);
+	mysql_get_option(conn, MYSQL_OPT_WRITE_TIMEOUT, &writeTimeout);
+	*/
+
+	uint timeout = 10;
+	mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+	//Else during long query you will have error 2013
+	//mysql_options(conn, MYSQL_OPT_READ_TIMEOUT, &timeout);
+	mysql_options(conn, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+
+	if (conf.allowLocalInfile) {
+		uint one = 1;
+		mysql_options(conn, MYSQL_OPT_LOCAL_INFILE, &one);
+	}
+
+	clientFlag = CLIENT_MULTI_STATEMENTS;
+	if (conf.ssl) {
+		mysql_options(conn, MYSQL_OPT_SSL_ENFORCE, &trueNonSense);
+		clientFlag |= CLIENT_SSL;
+	}
+	return conn;
 }
 
 bool DB::tryConnect() const {
@@ -523,16 +1147,122 @@ quint64 getId(const sqlResult& res) {
 	return 0;
 }
 
+struct SQLBuffering::AsyncFlusher {
+	std::mutex              mutex;
+	std::condition_variable cv;
+	//buffer handed over by flush, waiting to be written
+	std::deque<QByteArrayList> queue;
+	bool                       writing     = false;
+	bool                       stop        = false;
+	uint                       maxInFlight = 2;
+	std::exception_ptr         error;
+	//error is set, so append can check it without the lock
+	std::atomic<bool> failed{false};
+	//resolved once queue is empty and nothing is being written
+	std::vector<std::promise<void>> drainWaiters;
+	std::thread                     thread;
+
+	//must be called with the lock held
+	void rethrowLocked() {
+		if (error) {
+			auto e = std::exchange(error, nullptr);
+			failed = false;
+			std::rethrow_exception(e);
+		}
+	}
+
+	//must be called with the lock held
+	void resolveLocked() {
+		if (!queue.empty() || writing) {
+			return;
+		}
+		for (auto& w : drainWaiters) {
+			if (error) {
+				w.set_exception(error);
+			} else {
+				w.set_value();
+			}
+		}
+		if (!drainWaiters.empty()) {
+			//already reported to someone waiting
+			error  = nullptr;
+			failed = false;
+		}
+		drainWaiters.clear();
+	}
+
+	void loop(SQLBuffering* owner) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			cv.wait(lock, [&] { return stop || !queue.empty(); });
+			if (queue.empty()) {
+				//stop
+				return;
+			}
+			auto lines = std::move(queue.front());
+			queue.pop_front();
+			writing = true;
+			lock.unlock();
+			//make room for the producer asap
+			cv.notify_all();
+
+			std::exception_ptr failure;
+			try {
+				owner->write(lines);
+			} catch (...) {
+				failure = std::current_exception();
+			}
+
+			lock.lock();
+			writing = false;
+			if (failure && !error) {
+				error  = failure;
+				failed = true;
+			}
+			resolveLocked();
+			cv.notify_all();
+		}
+	}
+};
+
 SQLBuffering::SQLBuffering(DB* _conn, uint _bufferSize) {
 	conn       = _conn;
 	bufferSize = _bufferSize;
 }
 
 SQLBuffering::~SQLBuffering() {
-	flush();
+	if (!flusher) {
+		flush();
+		return;
+	}
+	try {
+		drain();
+	} catch (const QString& e) {
+		qCritical().noquote() << "SQLBuffering background flush failed:" << e;
+	} catch (...) {
+		qCritical().noquote() << "SQLBuffering background flush failed";
+	}
+	{
+		std::lock_guard<std::mutex> guard(flusher->mutex);
+		flusher->stop = true;
+	}
+	flusher->cv.notify_all();
+	flusher->thread.join();
 }
 
 void SQLBuffering::append(const QString& sql) {
+	append(sql.toUtf8());
+}
+
+void SQLBuffering::append(const char* sql) {
+	append(QByteArray(sql));
+}
+
+void SQLBuffering::append(const QByteArray& sql) {
+	if (flusher && flusher->failed.load(std::memory_order_relaxed)) {
+		std::lock_guard<std::mutex> guard(flusher->mutex);
+		flusher->rethrowLocked();
+	}
 	buffer.append(sql);
 	if (sql.isEmpty()) {
 		return;
@@ -544,49 +1274,119 @@ void SQLBuffering::append(const QString& sql) {
 }
 
 void SQLBuffering::flush() {
+	if (flusher) {
+		std::unique_lock<std::mutex> lock(flusher->mutex);
+		flusher->rethrowLocked();
+		if (buffer.isEmpty()) {
+			return;
+		}
+		if (conn == nullptr) {
+			throw QSL("you forget to set a usable DB Conn!") + QStacker16();
+		}
+		//backpressure, the one being written is still in memory
+		flusher->cv.wait(lock, [&] { return flusher->queue.size() + (flusher->writing ? 1 : 0) < flusher->maxInFlight; });
+		//swap, so the front buffer is empty and ready
+		flusher->queue.push_back(std::move(buffer));
+		buffer = QByteArrayList();
+		lock.unlock();
+		flusher->cv.notify_all();
+		return;
+	}
+
 	if (buffer.isEmpty()) {
 		return;
 	}
 	if (conn == nullptr) {
 		throw QSL("you forget to set a usable DB Conn!") + QStacker16();
 	}
+	write(buffer);
+	buffer.clear();
+}
+
+void SQLBuffering::enableAsync(uint maxInFlight) {
+	if (flusher) {
+		return;
+	}
+	flusher              = std::make_unique<AsyncFlusher>();
+	flusher->maxInFlight = std::max(maxInFlight, 1u);
+	//the flusher thread will lease its own connection from the pool
+	flusher->thread = std::thread(&AsyncFlusher::loop, flusher.get(), this);
+}
+
+std::future<void> SQLBuffering::drainAsync() {
+	if (!flusher) {
+		flush();
+		std::promise<void> done;
+		done.set_value();
+		return done.get_future();
+	}
+	flush();
+	std::lock_guard<std::mutex> guard(flusher->mutex);
+	auto&                       waiter = flusher->drainWaiters.emplace_back();
+	auto                        future = waiter.get_future();
+	flusher->resolveLocked();
+	return future;
+}
+
+void SQLBuffering::drain() {
+	drainAsync().get();
+}
+
+void SQLBuffering::write(const QByteArrayList& lines) {
 	/**
-	 * To avoid having a very big packet we split
-	 * usually max_allowed_packet is https://mariadb.com/kb/en/server-system-variables/#max_allowed_packet
-	   16777216 (16M) >= MariaDB 10.2.4
-		4194304 (4M) >= MariaDB 10.1.7
-		1048576 (1MB) <= MariaDB 10.1.6
-	 1073741824 (1GB) (client-side)
-	 It should be nice to read the value from the conn ... ?
-	 TODO add
-	 show variables like "max_allowed_packet"
+	 * To avoid having a too big packet we split, the limit is the server max_allowed_packet
+	 * https://mariadb.com/kb/en/server-system-variables/#max_allowed_packet
+	 * the buffer is already UTF8 so the size is exact (the 1 byte of COM_QUERY is the safety margin)
 	 */
+	auto limit = static_cast<int>(conn->maxAllowedPacket() * packetFill) - 1;
+
+	SqlSpan span("flush");
+	span.setDetail(QByteArray::number(lines.size()) + " lines");
 
 	//This MUST be out of the buffered block!
 	if (useTRX) {
 		conn->query(QBL("START TRANSACTION;"));
 	}
 
-	QString query;
-	//TODO just compose the query in utf8, and append in utf8
-	for (auto&& line : buffer) {
-		query.append(line);
-		query.append(QSL("\n"));
-		//this is UTF16, but MySQL run in UTF8, so can be lower or bigger (rare vey rare but possible)
-		//small safety margin + increase size for UTF16 -> UTF8 conversion
-		if ((query.size() * 1.3) > maxPacket * 0.75) {
-			conn->queryDeadlockRepeater(query.toUtf8());
+	//else the connection is left in the transaction, and the next START TRANSACTION would commit the partial batch
+	auto rollback = qScopeGuard([&] {
+		if (useTRX) {
+			try {
+				conn->query(QBL("ROLLBACK;"));
+			} catch (...) {
+				//the connection is probably gone, and the transaction with it
+			}
+		}
+	});
+
+	QByteArray query;
+	query.reserve(limit);
+	for (auto&& line : lines) {
+		if (line.isEmpty()) {
+			continue;
+		}
+		if (!query.isEmpty() && query.size() + line.size() + 1 > limit) {
+			SqlSpan chunk("flush.chunk");
+			chunk.setDetail(QByteArray::number(query.size()));
+			conn->queryDeadlockRepeater(query);
 			query.clear();
 		}
+		if (line.size() + 1 > limit) {
+			qWarning().noquote() << "a single statement of" << line.size() << "byte is bigger than the max packet (" << limit << "), the server will most probably refuse it";
+		}
+		query.append(line);
+		query.append('\n');
 	}
 	if (!query.isEmpty()) {
-		conn->queryDeadlockRepeater(query.toUtf8());
+		SqlSpan chunk("flush.chunk");
+		chunk.setDetail(QByteArray::number(query.size()));
+		conn->queryDeadlockRepeater(query);
 	}
 	//This MUST be out of the buffered block!
 	if (useTRX) {
 		conn->query(QBL("COMMIT;"));
 	}
-	buffer.clear();
+	rollback.dismiss();
 }
 
 void SQLBuffering::setUseTRX(bool _useTRX) {
@@ -610,7 +1410,8 @@ sqlResult DB::query(const char* sql) const {
 }
 
 bool DB::isSSL() const {
-	auto res = query("SHOW STATUS LIKE 'Ssl_cipher'");
+	//session status, must come from our connection
+	auto res = queryDirect("SHOW STATUS LIKE 'Ssl_cipher'");
 	if (res.isEmpty()) {
 		return false;
 	} else {
@@ -622,7 +1423,9 @@ bool DB::isSSL() const {
 
 void DB::startQuery(const QByteArray& sql) const {
 	int  err;
-	auto conn  = getConn();
+	auto conn = getConn();
+	DBMetrics::queries().add();
+	DBMetrics::bytesSent().add(sql.size());
 	signalMask = mysql_real_query_start(&err, conn, sql.constData(), sql.length());
 	if (!signalMask) {
 		throw QSL("Error executing ASYNC query (start):") + mysql_error(conn);
@@ -667,82 +1470,199 @@ sqlResult DB::getWarning(bool useSuppressionList) const {
 	if (!warnCount) {
 		return ok;
 	}
-	auto res = query(QBL("SHOW WARNINGS"));
-	if (!useSuppressionList || conf.warningSuppression.isEmpty()) {
+	//the warnings of the last statement on our connection, never shared
+	auto res = queryDirect(QBL("SHOW WARNINGS"));
+	if (!useSuppressionList || warningSuppressors.isEmpty()) {
 		return res;
 	}
-	for (auto iter = res.begin(); iter != res.end(); ++iter) {
-		auto msg = iter->value(QBL("Message"), BSQL_NULL);
-		for (auto rx : conf.warningSuppression) {
-			auto p = rx.pattern();
+	for (auto& row : res) {
+		auto msg        = QString::fromUtf8(row.value(QBL("Message"), BSQL_NULL));
+		bool suppressed = false;
+		for (auto& rx : warningSuppressors) {
 			if (rx.match(msg).hasMatch()) {
+				suppressed = true;
 				break;
-			} else {
-				ok.append(*iter);
 			}
 		}
+		if (!suppressed) {
+			ok.append(row);
+		}
 	}
 	return ok;
 }
 
+bool DB::wantWarnings(const QByteArray& sql, uint count) const {
+	DBMetrics::warnings().add(count);
+
+	auto policy = conf.warningPolicy;
+	if (!conf.warningPolicyByVerb.isEmpty()) {
+		auto trimmed = sql.trimmed();
+		auto end     = 0;
+		while (end < trimmed.size() && isalpha(static_cast<uchar>(trimmed[end]))) {
+			end++;
+		}
+		policy = conf.warningPolicyByVerb.value(trimmed.left(end).toUpper(), policy);
+	}
+
+	switch (policy) {
+	case WarningPolicy::always:
+		return true;
+	case WarningPolicy::sampled: {
+		static std::atomic<uint> tick{0};
+		return tick.fetch_add(1, std::memory_order_relaxed) % std::max(conf.warningSample, 1u) == 0;
+	}
+	case WarningPolicy::count:
+		return false;
+	}
+	return true;
+}
+
+void DB::reportWarnings(const QByteArray& sql, const sqlResult& warnings) const {
+	if (warnings.isEmpty()) {
+		return;
+	}
+	if (!conf.warningInterval) {
+		qDebug().noquote() << "warning for " << sql << warnings << "\n"
+		                   << QStacker16Light();
+		return;
+	}
+
+	//the same code for the same query shape is logged once per interval, with how many were swallowed in the meantime
+	struct Seen {
+		qint64 lastLog    = 0;
+		uint   suppressed = 0;
+	};
+	static std::mutex               mutex;
+	static QHash<QByteArray, Seen> seen;
+	static qint64                  lastSweep = 0;
+
+	auto digest = QByteArray::number(QueryStats::digestOf(QueryStats::fingerprint(sql)));
+	auto now    = QDateTime::currentSecsSinceEpoch();
+
+	QMap<QByteArray, sqlResult> byCode;
+	for (auto& row : warnings) {
+		byCode[row.value(QBL("Code"))].append(row);
+	}
+	for (auto iter = byCode.begin(); iter != byCode.end(); ++iter) {
+		uint suppressed = 0;
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			//once per interval forget what was not seen in the last one, so the hash does not grow with each code x query shape
+			if (now - lastSweep >= conf.warningInterval) {
+				lastSweep = now;
+				for (auto old = seen.begin(); old != seen.end();) {
+					if (now - old->lastLog >= conf.warningInterval) {
+						old = seen.erase(old);
+					} else {
+						++old;
+					}
+				}
+			}
+			auto& s = seen[iter.key() + '|' + digest];
+			if (now - s.lastLog < conf.warningInterval) {
+				s.suppressed++;
+				continue;
+			}
+			suppressed   = s.suppressed;
+			s.lastLog    = now;
+			s.suppressed = 0;
+		}
+		auto msg = QSL("warning for %1").arg(QString(sql));
+		if (suppressed) {
+			msg += QSL(" (%1 more in the last %2 sec)").arg(suppressed).arg(conf.warningInterval);
+		}
+		qDebug().noquote() << msg << iter.value() << "\n"
+		                   << QStacker16Light();
+	}
+}
+
+/**
+ * @brief appendRows convert a whole MYSQL_RES into sqlRow
+ * The field name are read only once per result set, and shared (implicit sharing) across all the row
+ */
+quint64 appendRows(MYSQL_RES* result, sqlResult& res, bool NULL_as_EMPTY) {
+	auto         num_fields = mysql_num_fields(result);
+	MYSQL_FIELD* fields     = mysql_fetch_fields(result);
+
+	std::vector<QByteArray> names;
+	names.reserve(num_fields);
+	for (uint i = 0; i < num_fields; i++) {
+		names.emplace_back(fields[i].name);
+	}
+
+	my_ulonglong row_count = mysql_num_rows(result);
+	quint64      bytes     = 0;
+	res.reserve(res.size() + static_cast<int>(row_count));
+	for (uint j = 0; j < row_count; j++) {
+		MYSQL_ROW row     = mysql_fetch_row(result);
+		auto      lengths = mysql_fetch_lengths(result);
+		sqlRow    thisItem;
+		for (uint i = 0; i < num_fields; i++) {
+			bytes += lengths[i];
+			//this is how sql NULL is signaled, instead of having a wrapper and check ALWAYS before access, we normally just ceck on result swap if a NULL has any sense here or not.
+			//Plus if you have the string NULL in a DB you are really looking for trouble
+			if (row[i] == nullptr && lengths[i] == 0) {
+				if (NULL_as_EMPTY) {
+					thisItem.insert(names[i], QByteArray());
+				} else {
+					thisItem.insert(names[i], BSQL_NULL);
+				}
+			} else {
+				thisItem.insert(names[i], QByteArray(row[i], static_cast<int>(lengths[i])));
+			}
+		}
+		res.push_back(thisItem);
+	}
+	return bytes;
+}
+
 sqlResult DB::fetchResult(SQLLogger* sqlLogger) const {
 	QElapsedTimer timer;
 	timer.start(); //this will be stopped in the destructor of sql logger
 	//most inefficent way, but most easy to use!
 	sqlResult res;
-	res.reserve(512);
 
 	if (sqlLogger) {
 		sqlLogger->res = &res;
 	}
 
 	auto conn = getConn();
-	//If you batch more than two select, you are crazy, just the first one will be returned and you will be in bad situation later
+	//All the result set are merged, use queryMulti to have them one by one
 	//this iteration is just if you batch mulitple update, result is NULL, but mysql insist that you fetch them...
 	do {
 		//swap the whole result set we do not expect 1Gb+ result set here
+		SqlSpan    store("store", mysql_thread_id(conn));
 		MYSQL_RES* result = mysql_store_result(conn);
+		store.end();
 
 		if (result != nullptr) {
-			my_ulonglong row_count = mysql_num_rows(result);
-			for (uint j = 0; j < row_count; j++) {
-				MYSQL_ROW    row        = mysql_fetch_row(result);
-				auto         num_fields = mysql_num_fields(result);
-				MYSQL_FIELD* fields     = mysql_fetch_fields(result);
-				sqlRow       thisItem;
-				auto         lengths = mysql_fetch_lengths(result);
-				for (uint16_t i = 0; i < num_fields; i++) {
-					//this is how sql NULL is signaled, instead of having a wrapper and check ALWAYS before access, we normally just ceck on result swap if a NULL has any sense here or not.
-					//Plus if you have the string NULL in a DB you are really looking for trouble
-					if (row[i] == nullptr && lengths[i] == 0) {
-						if (state.get().NULL_as_EMPTY) {
-							thisItem.insert(fields[i].name, QByteArray());
-						} else {
-							thisItem.insert(fields[i].name, BSQL_NULL);
-						}
-					} else {
-						thisItem.insert(fields[i].name, QByteArray(row[i], static_cast<int>(lengths[i])));
-					}
-				}
-				res.push_back(thisItem);
-			}
+			SqlSpan convert("convert", mysql_thread_id(conn));
+			auto    bytes = appendRows(result, res, state.get().NULL_as_EMPTY);
 			mysql_free_result(result);
+			if (sqlLogger) {
+				sqlLogger->bytes += bytes;
+			}
 		}
 	} while (mysql_next_result(conn) == 0);
-	sqlLogger->fetchTime = timer.nsecsElapsed();
+	if (sqlLogger) {
+		sqlLogger->fetchTime = timer.nsecsElapsed();
+		sqlLogger->rows      = static_cast<quint64>(res.size());
+	}
+
+	afterFetch(conn, sqlLogger);
+	return res;
+}
 
+void DB::afterFetch(st_mysql* conn, SQLLogger* sqlLogger) const {
 	affectedRows = mysql_affected_rows(conn);
 
 	//auto affected  = mysql_affected_rows(conn);
 	if (skipWarning) {
 		//reset
 		skipWarning = false;
-	} else {
-		auto warn = this->getWarning(true);
-		if (!warn.isEmpty()) {
-			qDebug().noquote() << "warning for " << lastSQL << warn << "\n"
-			                   << QStacker16Light();
-		}
+	} else if (auto count = mysql_warning_count(conn); count && wantWarnings(lastSQL, count)) {
+		SqlSpan span("warnings", mysql_thread_id(conn));
+		reportWarnings(lastSQL, this->getWarning(true));
 	}
 
 	unsigned int error = mysql_errno(conn);
@@ -750,12 +1670,11 @@ sqlResult DB::fetchResult(SQLLogger* sqlLogger) const {
 		sqlLogger->error = mysql_error(conn);
 	}
 	if (error) {
+		DBMetrics::errors(error).add();
 		qWarning().noquote() << "Mysql error for " << lastSQL << "error was " << mysql_error(conn) << " code: " << error << QStacker(3);
 		cxaNoStack = true;
 		throw error;
 	}
-
-	return res;
 }
 
 int DB::fetchAdvanced(FetchVisitor* visitor) const {
@@ -819,6 +1738,63 @@ static int somethingHappened(MYSQL* mysql, int status) {
 	}
 }
 
+/**
+ * @brief isReadOnly true if the statement can be safely sent again
+ * only a single SELECT / SHOW / DESCRIBE / EXPLAIN (a multi statement is never considered safe)
+ */
+static bool isReadOnly(const QByteArray& sql) {
+	auto trimmed = sql.trimmed();
+	while (trimmed.endsWith(';')) {
+		trimmed.chop(1);
+		trimmed = trimmed.trimmed();
+	}
+	if (trimmed.contains(';')) {
+		return false;
+	}
+	while (trimmed.startsWith('(')) {
+		trimmed = trimmed.mid(1).trimmed();
+	}
+	static const QByteArrayList readOnly = {"SELECT", "SHOW", "DESC", "EXPLAIN"};
+	auto                        verb     = trimmed.left(7).toUpper();
+	for (auto& v : readOnly) {
+		if (verb.startsWith(v)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief isShareable true if the result does not depend on the connection that runs it, so can be given to another session
+ * SHOW (warnings, session status...), user and session variables and the function bound to the connection state are excluded
+ */
+static bool isShareable(const QByteArray& sql) {
+	if (!isReadOnly(sql)) {
+		return false;
+	}
+	auto upper = sql.trimmed().toUpper();
+	while (upper.startsWith('(')) {
+		upper = upper.mid(1).trimmed();
+	}
+	if (!upper.startsWith("SELECT")) {
+		return false;
+	}
+	//@var and @@session.var
+	if (upper.contains('@')) {
+		return false;
+	}
+	static const QByteArrayList sessionBound = {
+	    "LAST_INSERT_ID", "FOUND_ROWS", "ROW_COUNT", "CONNECTION_ID", "GET_LOCK", "RELEASE_LOCK", "RELEASE_ALL_LOCKS",
+	    "IS_USED_LOCK", "IS_FREE_LOCK", "LASTVAL", "NEXTVAL", "SETVAL", "DATABASE(", "SCHEMA(", "USER(", "CURRENT_USER",
+	    "CURRENT_ROLE", "SLEEP", "FOR UPDATE", "LOCK IN SHARE MODE", "INTO "};
+	for (auto& f : sessionBound) {
+		if (upper.contains(f)) {
+			return false;
+		}
+	}
+	return true;
+}
+
 SQLLogger::SQLLogger(const QByteArray& _sql, bool _enabled, const DB* _db)
     : sql(_sql), logError(_enabled), db(_db) {
 }
@@ -831,49 +1807,36 @@ void SQLLogger::flush() {
 		return;
 	}
 	flushed = true;
-	static std::mutex            lock;
-	std::scoped_lock<std::mutex> scoped(lock);
-
-	//we keep open a file and just append from now on...
-	//for the moment is just a single file later... who knows
-	static QFile file;
-	if (!file.isOpen()) {
-		file.setFileName("sql.log");
-		if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
-			qWarning().noquote() << "impossible to open sql.log";
-			return;
-		}
-	}
 
-	QDateTime myDateTime = QDateTime::currentDateTime();
-	QString   time       = myDateTime.toString(Qt::ISODateWithMs);
-	file.write(time.toUtf8() + "\n");
+	static const quint32 pid = static_cast<quint32>(getpid());
 
-	auto    pid           = getpid();
-	auto    mysqlThreadId = mysql_thread_id(db->getConn());
-	QString info          = QSL("PID: %1, MySQL Thread: %2 \n").arg(pid).arg(mysqlThreadId);
-
-	file.write(info.toUtf8());
-
-	double     query = serverTime / 1E9;
-	double     fetch = fetchTime / 1E9;
-	QByteArray buff  = "Query: " + QByteArray::number(query, 'E', 3);
-	file.write(buff.leftJustified(20, ' ').append("Fetch: " + QByteArray::number(fetch, 'E', 3)) + "\n" + sql);
+	//only encoded here, the disk is written by the SqlLogWriter thread
+	SqlLogWriter::Record record;
+	record.timestamp     = QDateTime::currentMSecsSinceEpoch();
+	record.serverTime    = serverTime;
+	record.fetchTime     = fetchTime;
+	record.pid           = pid;
+	record.mysqlThreadId = db ? db->threadId() : 0;
+	record.sql           = sql;
 	if (!error.isEmpty()) {
-		file.write(QBL("\nError: ") + error.toUtf8());
+		record.error = error.toUtf8();
 		if (res && !res->isEmpty()) {
-			file.write("\n");
 			//nice trick to use qDebug operator << on a custom stream!
-			QDebug dbg(&file);
+			QString dump;
+			QDebug  dbg(&dump);
 			dbg << (*res);
+			record.res = dump.toUtf8();
 		}
 	}
-
-	file.write("\n-------------\n");
-	file.flush();
+	SqlLogWriter::instance().log(record);
 }
 
 SQLLogger::~SQLLogger() {
+	DBMetrics::rowsFetched().add(static_cast<qint64>(rows));
+	DBMetrics::bytesReceived().add(static_cast<qint64>(bytes));
+	if (stats) {
+		QueryStats::record(sql, serverTime, fetchTime, rows, bytes);
+	}
 	flush();
 }
 
@@ -908,74 +1871,125 @@ void Runnable::setConf(const DBConf& conf) {
 	db.setConf(conf);
 	//this will check if we have the proper table and column available in the selected DB
 	try {
-		auto row = db.queryLine("SELECT id, operationCode FROM runnable ORDER BY lastRun DESC LIMIT 1");
+		auto row = db.queryLine("SELECT operationCode, lastRun FROM runnable LIMIT 1");
 	} catch (QString e) {
 		QString msg = R"(
 Is probably missing the runnable table in the db %1, create it with
 CREATE TABLE `runnable` (
-	`id` int(10) unsigned NOT NULL AUTO_INCREMENT,
-	`operationCode` varchar(65000) CHARACTER SET ascii COLLATE ascii_bin NOT NULL,
+	`operationCode` varchar(255) CHARACTER SET ascii COLLATE ascii_bin NOT NULL,
 	`lastRun` int(10) unsigned NOT NULL,
 	`orario` datetime GENERATED ALWAYS AS (from_unixtime(`lastRun`)) VIRTUAL,
-	PRIMARY KEY (`id`),
-KEY `lastRun` (`lastRun`)
+	PRIMARY KEY (`operationCode`)
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8;
 					  )";
 		throw msg.arg(QString(db.getConf().getDefaultDB()));
 	}
+
+	//the claim is an upsert, without a unique key on operationCode (the old schema) every call would insert a new row and return true
+	QMap<QByteArray, QByteArrayList> uniqueKeys;
+	for (auto& row : db.query("SHOW INDEX FROM runnable")) {
+		if (row.value("Non_unique") == "0") {
+			uniqueKeys[row.value("Key_name")].append(row.value("Column_name"));
+		}
+	}
+	for (auto& columns : uniqueKeys) {
+		if (columns == QByteArrayList{"operationCode"}) {
+			return;
+		}
+	}
+	QString msg = R"(
+The runnable table in the db %1 has the old schema, without a unique key on operationCode, migrate it with
+CREATE TABLE `runnable_new` (
+	`operationCode` varchar(255) CHARACTER SET ascii COLLATE ascii_bin NOT NULL,
+	`lastRun` int(10) unsigned NOT NULL,
+	`orario` datetime GENERATED ALWAYS AS (from_unixtime(`lastRun`)) VIRTUAL,
+	PRIMARY KEY (`operationCode`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+INSERT INTO runnable_new (operationCode, lastRun) SELECT operationCode, MAX(lastRun) FROM runnable GROUP BY operationCode;
+RENAME TABLE runnable TO runnable_old, runnable_new TO runnable;
+The key is now limited to 255 char (was 65000), check for longer one with
+SELECT operationCode FROM runnable WHERE LENGTH(operationCode) > 255;
+					  )";
+	throw msg.arg(QString(db.getConf().getDefaultDB()));
 }
 
 bool Runnable::runnable(const QString& key, qint64 second) {
-	static const QString skel = "SELECT id, lastRun FROM runnable WHERE operationCode = %1 ORDER BY lastRun DESC LIMIT 1";
-	auto                 now  = QDateTime::currentSecsSinceEpoch();
-	auto                 sql  = skel.arg(base64this(key));
-	auto                 res  = db.query(sql);
-	if (res.isEmpty() or res.at(0).value("lastRun", BZero).toLongLong() + second < now) {
-		static const QString insertSkel = "INSERT INTO runnable SET operationCode = %1, lastRun = %2";
-		auto                 insertSql  = insertSkel.arg(base64this(key)).arg(now);
-		db.query(insertSql);
-
-		return true;
-	} else {
+	auto now = QDateTime::currentSecsSinceEpoch();
+	if (coolingDown(key, second, now)) {
+		return false;
+	}
+	auto res = db.queryMulti(QByteArrayList{claimSql(key, second, now)});
+	if (res.empty()) {
 		return false;
 	}
+	remember(key, res.at(0), second, now);
+	return res.at(0).affectedRows > 0;
 }
 
-QString sqlRow::serialize() const {
-	//Almost free operator <<
-	QString out;
-	QDebug  dbg(&out);
-	dbg << (*this);
-	return out;
-}
+QStringList Runnable::runnable(const QStringList& keys, qint64 second) {
+	auto           now = QDateTime::currentSecsSinceEpoch();
+	QStringList    asked;
+	QByteArrayList sql;
+	for (auto& key : keys) {
+		if (coolingDown(key, second, now)) {
+			continue;
+		}
+		asked.append(key);
+		sql.append(claimSql(key, second, now));
+	}
 
-void ConnPooler::addConnPool(st_mysql* conn) {
-	lock_guard<mutex> guard(allConnMutex);
-	allConn.insert({conn, true});
+	QStringList ok;
+	auto        res = db.queryMulti(sql);
+	for (uint i = 0; i < res.size(); i++) {
+		remember(asked.at(static_cast<int>(i)), res.at(i), second, now);
+		if (res.at(i).affectedRows > 0) {
+			ok.append(asked.at(static_cast<int>(i)));
+		}
+	}
+	return ok;
 }
 
-void ConnPooler::removeConn(st_mysql* conn) {
-	lock_guard<mutex> guard(allConnMutex);
-	if (auto iter = allConn.find(conn); iter != allConn.end()) {
-		allConn.erase(iter);
-	}
+QByteArray Runnable::claimSql(const QString& key, qint64 second, qint64 now) const {
+	/*
+	 * affected rows is 1 for a new key, 2 if the row is updated (we can run) and 0 if left as it is (still cooling down).
+	 * In the last case LAST_INSERT_ID(lastRun) hands back the current lastRun, so it can be remembered without another query
+	 */
+	static const QString skel = R"(INSERT INTO runnable (operationCode, lastRun) VALUES (%1, %2)
+ON DUPLICATE KEY UPDATE lastRun = IF(lastRun + %3 < VALUES(lastRun), VALUES(lastRun), LAST_INSERT_ID(lastRun)))";
+	return skel.arg(base64this(key)).arg(now).arg(second).toUtf8();
 }
 
-void ConnPooler::closeAll() {
-	lock_guard<mutex> guard(allConnMutex);
-	for (auto& [conn, dummy] : allConn) {
-		mysql_close(conn);
-	}
-	allConn.clear();
+bool Runnable::coolingDown(const QString& key, qint64 second, qint64 now) {
+	auto last = lastRun.get(key);
+	return last && *last + second >= now;
 }
 
-const map<st_mysql*, bool>& ConnPooler::getPool() const {
-	return allConn;
+void Runnable::remember(const QString& key, const sqlStatementResult& res, qint64 second, qint64 now) {
+	qint64 last = 0;
+	if (res.affectedRows > 0) {
+		last = now;
+	} else if (res.insertId) {
+		last = static_cast<qint64>(res.insertId);
+	} else {
+		return;
+	}
+	if (auto known = lastRun.get(key); known) {
+		last = std::max(*known, last);
+	}
+	//useless once the cool down is over, so it expires there
+	auto left = last + second - now;
+	if (left <= 0) {
+		return;
+	}
+	lastRun.put(key, std::make_shared<const qint64>(last), static_cast<uint>(left), static_cast<quint64>(key.size() * 2 + 64));
 }
 
-ConnPooler::~ConnPooler() {
-	active = 0;
-	closeAll();
+QString sqlRow::serialize() const {
+	//Almost free operator <<
+	QString out;
+	QDebug  dbg(&out);
+	dbg << (*this);
+	return out;
 }
 
 DBException::DBException(const QString& _msg, Error error)
@@ -3,11 +3,22 @@
 #include "MITLS.h"
 #include "QStacker/qstacker.h"
 #include "const.h"
+#include "lrucache.h"
 #include "magicEnum/magic_from_string.hpp"
 #include "mapExtensor/qmapV2.h"
+#include "sqlparse.h"
 #include <QDateTime>
+#include <QHash>
 #include <QRegularExpression>
+#include <QSet>
 #include <QStringList>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <tuple>
+#include <vector>
 
 #ifndef QBL
 #define QBL(str) QByteArrayLiteral(str)
@@ -38,10 +49,55 @@ QString base64this(const std::string& param);
 QString mayBeBase64(const QString& original, bool emptyAsNull = false);
 QString base64Nullable(const QString& param, bool emptyAsNull = false);
 QString nullOnZero(uint v);
+//`name`, or `db`.`name` (an already quoted part is accepted), a backtick inside is doubled
+QString quoteIdentifier(const QString& name);
 
 struct st_mysql;
 struct st_mysql_res;
 
+/**
+ * @brief sqlSwap convert a cell (in the mysql text protocol format) into D
+ * all the result type (sqlRow, columnar, view) use this one, so they all agree on what a cell means
+ */
+template <typename D>
+void sqlSwap(std::string_view source, D& dest) {
+	if constexpr (std::is_same<D, QString>::value) {
+		dest = QString::fromUtf8(source.data(), static_cast<int>(source.size()));
+		return;
+	} else if constexpr (std::is_same<D, QByteArray>::value) {
+		dest = QByteArray(source.data(), static_cast<int>(source.size()));
+		return;
+	} else if constexpr (std::is_same<D, std::string>::value) {
+		dest = std::string(source);
+		return;
+	} else if constexpr (std::is_same<D, QDate>::value) {
+		dest = sqlParse::date(source);
+		return;
+	} else if constexpr (std::is_same<D, QDateTime>::value) {
+		dest = sqlParse::dateTime(source);
+		return;
+	} else if constexpr (std::is_enum_v<D>) {
+		auto s = std::string(source);
+		magic_enum::fromString(s, dest);
+		return;
+	} else if constexpr (std::is_arithmetic_v<D>) {
+		if (!sqlParse::number(source, dest)) {
+			//last chanche NULL is 0 in case we are numeric right ?
+			if (source == std::string_view("NULL")) {
+				dest = 0;
+				return;
+			}
+			throw QSL("Impossible to convert %1 as a number").arg(QString::fromUtf8(source.data(), static_cast<int>(source.size())));
+		}
+	} else {
+		//poor man static assert that will also print for which type it failed
+		typedef typename D::something_made_up X;
+
+		X y;     //To avoid complain that X is defined but not used
+		(void)y; //TO avoid complain that y is unused
+	}
+}
+
 class sqlRow : public QMapV2<QByteArray, QByteArray> {
       public:
 	template <typename D>
@@ -52,8 +108,7 @@ class sqlRow : public QMapV2<QByteArray, QByteArray> {
 	}
 
 	QDateTime asDateTime(const QByteArray& key) const {
-		auto time = get2<QString>(key);
-		return QDateTime::fromString(time, mysqlDateTimeFormat);
+		return get2<QDateTime>(key);
 	}
 
 	template <typename D>
@@ -98,50 +153,11 @@ class sqlRow : public QMapV2<QByteArray, QByteArray> {
       private:
 	template <typename D>
 	void swap(const QByteArray& source, D& dest) const {
-		if constexpr (std::is_same<D, QString>::value) {
-			dest = QString(source);
-			return;
-		} else if constexpr (std::is_same<D, QByteArray>::value) {
+		if constexpr (std::is_same<D, QByteArray>::value) {
+			//implicit sharing, no copy
 			dest = source;
-			return;
-		} else if constexpr (std::is_same<D, std::string>::value) {
-			dest = source.toStdString();
-			return;
-		} else if constexpr (std::is_same<D, QDate>::value) {
-			dest = QDate::fromString(source, mysqlDateFormat);
-			return;
-		} else if constexpr (std::is_same<D, QDateTime>::value) {
-			dest = QDateTime::fromString(source, mysqlDateTimeFormat);
-			return;
-		} else if constexpr (std::is_enum_v<D>) {
-			auto s = source.toStdString();
-			magic_enum::fromString(s, dest);
-			return;
-		} else if constexpr (std::is_arithmetic_v<D>) {
-			bool ok = false;
-			if constexpr (std::is_floating_point_v<D>) {
-				dest = source.toDouble(&ok);
-			} else if constexpr (std::is_signed_v<D>) {
-				dest = source.toLongLong(&ok);
-			} else if constexpr (std::is_unsigned_v<D>) {
-				dest = source.toULongLong(&ok);
-			}
-			if (!ok) {
-				//last chanche NULL is 0 in case we are numeric right ?
-				if (source == QBL("NULL")) {
-					if constexpr (std::is_arithmetic_v<D>) {
-						dest = 0;
-						return;
-					}
-				}
-				throw QSL("Impossible to convert %1 as a number").arg(QString(source));
-			}
 		} else {
-			//poor man static assert that will also print for which type it failed
-			typedef typename D::something_made_up X;
-
-			X y;     //To avoid complain that X is defined but not used
-			(void)y; //TO avoid complain that y is unused
+			sqlSwap(std::string_view(source.constData(), static_cast<size_t>(source.size())), dest);
 		}
 	}
 };
@@ -155,8 +171,10 @@ struct SQLLogger {
 	void flush();
 	~SQLLogger();
 
-	qint64           serverTime;
-	qint64           fetchTime;
+	qint64           serverTime = 0;
+	qint64           fetchTime  = 0;
+	quint64          rows       = 0;
+	quint64          bytes      = 0;
 	const QByteArray sql;
 	const sqlResult* res = nullptr;
 	QString          error;
@@ -164,9 +182,22 @@ struct SQLLogger {
 	bool logSql   = false;
 	bool logError = false;
 	bool flushed  = false;
+	//feed QueryStats
+	bool stats = false;
 	//the invoking class
 	const DB* db = nullptr;
 };
+/**
+ * What to do when a statement raise warning, SHOW WARNINGS is an extra round trip
+ * always: fetch and log them, sampled: fetch one time every DBConf::warningSample, count: only count them (minmysql_warnings_total)
+ * The warning are lost as soon as the next statement runs, so they can not be fetched later
+ */
+enum class WarningPolicy {
+	always,
+	sampled,
+	count
+};
+
 //class QRegularExpression;
 struct DBConf {
 	DBConf();
@@ -181,29 +212,112 @@ struct DBConf {
 	uint                      port            = 3306;
 	bool                      logSql          = false;
 	bool                      logError        = false;
+	bool                      queryStats      = false; //Per fingerprint latency histogram, see QueryStats
 	bool                      pingBeforeQuery = true; //So if the connection is broken will be re-established
+	uint                      pingIdleMs      = 2000; //Ping only if the connection was idle longer than this, 0 = before every query
+	uint                      stmtCacheSize   = 64;   //Prepared statement kept open per connection
+	//Connection pool, shared by all the DB with the same poolKey, the first DB to create the pool decides those value
+	uint poolMaxSize      = 0;   //0 = unbounded, else a thread waits for a free connection (each DB holds one per thread until releaseConn, see ConnPool)
+	uint poolMinIdle      = 0;   //idle connection never reaped
+	uint poolIdleTimeout  = 300; //seconds an idle connection is kept open, 0 = forever
+	uint poolWaitTimeout  = 10;  //seconds to wait for a free connection before throwing
+	uint poolValidateIdle = 30;  //seconds of idle after which a connection is pinged before being handed out
 	//In certain case not beeing able to connect is bad, in other not and we just go ahead, retry later...
 	CxaLevel connErrorVerbosity = CxaLevel::none;
+	//Concurrent identical SELECT (outside a transaction) are executed once and the result shared, see DB::queryCoalesced
+	//SHOW, @variables and the session bound function (LAST_INSERT_ID, GET_LOCK...) are never coalesced
+	bool coalesceSelect = false;
+	//Needed by DB::loadData, off by default as it allows the server to ask for any local file
+	bool allowLocalInfile = false;
+	//See WarningPolicy
+	WarningPolicy warningPolicy   = WarningPolicy::always;
+	uint          warningSample   = 100; //with WarningPolicy::sampled, 1 statement every N is checked
+	uint          warningInterval = 10;  //seconds, the same warning code for the same query shape is logged once per interval, 0 = always
+	//Per statement class (the first word, uppercase: INSERT, LOAD ...), override warningPolicy. Use count for the load that expects warnings
+	QHash<QByteArray, WarningPolicy> warningPolicyByVerb;
 
 	//Corpus munus
 	QByteArray getDefaultDB() const;
 	void       setDefaultDB(const QByteArray& value);
 	QString    getInfo(bool passwd = false) const;
+	//DBConf that produce the same server session share the same connection pool
+	QByteArray poolKey() const;
+	//statements (multi statement) run on every new connection
+	QByteArray sessionSetup() const;
 
       private:
 	QByteArray defaultDB;
 };
 
+//mysql_init plus all our options (non blocking, compression, utf8mb4, timeout, ssl), used by DB::connect and AsyncEngine
+st_mysql* mysqlInit(const DBConf& conf, unsigned long& clientFlag);
+//convert a whole result set into sqlRow, returns the size of the cells
+quint64 appendRows(st_mysql_res* result, sqlResult& res, bool NULL_as_EMPTY);
+//rough memory used by a result (key and value share the storage across rows, so is an upper bound)
+quint64 sqlResultCost(const sqlResult& res);
+
+/**
+ * @brief The sqlStatementResult struct is the outcome of one statement of DB::queryMulti
+ */
+struct sqlStatementResult {
+	sqlResult rows;
+	//for a SELECT is the number of row
+	qint64  affectedRows = 0;
+	quint64 insertId     = 0;
+	uint    warningCount = 0;
+};
+
+struct LoadDataResult {
+	//as reported by the server (affected rows)
+	quint64   rows    = 0;
+	quint64   skipped = 0;
+	sqlResult warnings;
+};
+
+enum class LoadDataMode {
+	Plain,
+	Replace,
+	Ignore
+};
+
+using RowGenerator = std::function<bool(QByteArrayList& row)>;
+
+/**
+ * @brief The ConnStats struct how much the idle aware liveness check is saving (or costing) on a connection
+ */
+struct ConnStats {
+	uint pingDone    = 0;
+	uint pingSkipped = 0;
+	//statement sent again after a lost connection
+	uint retryDone = 0;
+};
+
 /**
  * @brief The DB struct
  */
 class FetchVisitor;
+class sqlColumnarResult;
+class sqlResultView;
+class PreparedStatement;
+class StmtCache;
+struct StmtHandle;
+class ConnPool;
+template <typename K, typename V>
+class ShardedLRU;
+class sqlMappedResult;
+#if defined(__cpp_impl_coroutine)
+template <typename T = void>
+class Task;
+class CoScheduler;
+#endif
 struct DB {
       public:
 	DB() = default;
 	DB(const DBConf& _conf);
 	~DB();
 	void      closeConn() const;
+	//give back the connection of this thread to the pool (it is not closed), the next query will lease one again
+	void      releaseConn() const;
 	st_mysql* connect() const;
 	bool      tryConnect() const;
 	sqlRow    queryLine(const char* sql) const;
@@ -215,6 +329,61 @@ struct DB {
 	sqlResult query(const QString& sql) const;
 	sqlResult query(const QByteArray& sql) const;
 
+	//All the statements are sent in a single round trip, one result per statement
+	//Concurrent caller with the same (normalized) sql and conf wait for the first one and share its result
+	//No check is done, the caller must be sure the result does not depend on the session
+	sqlResult queryCoalesced(const QByteArray& sql) const;
+	//how many query got the result of another one
+	static quint64 getCoalescedCount();
+
+	std::vector<sqlStatementResult> queryMulti(const QByteArrayList& statements) const;
+	std::vector<sqlStatementResult> queryMulti(const QStringList& statements) const;
+
+	/**
+	 * @brief loadData streams the rows into LOAD DATA LOCAL INFILE (as TSV), no temp file and no full copy in memory
+	 * the generator fills row and returns false once over, a null QByteArray is sql NULL (an empty one is '')
+	 * table (or db.table) and columns are plain names, they are backtick quoted here
+	 * requires DBConf::allowLocalInfile
+	 */
+	LoadDataResult loadData(const QString& table, const QStringList& columns, const RowGenerator& generator, LoadDataMode mode = LoadDataMode::Plain) const;
+	//anything iterable of QByteArrayList
+	template <typename Range>
+	LoadDataResult loadData(const QString& table, const QStringList& columns, const Range& range, LoadDataMode mode = LoadDataMode::Plain) const {
+		auto iter = std::begin(range);
+		auto end  = std::end(range);
+		return loadData(
+		    table, columns, [&](QByteArrayList& row) {
+			    if (iter == end) {
+				    return false;
+			    }
+			    row = *iter;
+			    ++iter;
+			    return true;
+		    },
+		    mode);
+	}
+
+	//Same as query, but the result is stored in a single arena, use for big result set
+	sqlColumnarResult queryColumnar(const QString& sql) const;
+	sqlColumnarResult queryColumnar(const QByteArray& sql) const;
+	//Zero copy, the cell point inside the mysql buffer, use for the (very common) read 2 column and throw away
+	sqlResultView queryView(const QString& sql) const;
+	sqlResultView queryView(const QByteArray& sql) const;
+
+	//Typed mapping, the column binding is resolved once per result set, include sqlmapping.h to use them
+	template <typename T>
+	std::vector<T> queryAs(const QString& sql) const;
+	template <typename T>
+	std::vector<T> queryAs(const QByteArray& sql) const;
+	template <typename... T>
+	std::vector<std::tuple<T...>> queryTuple(const QString& sql) const;
+	template <typename... T>
+	std::vector<std::tuple<T...>> queryTuple(const QByteArray& sql) const;
+
+	//Binary protocol, the statement handle is cached per connection, include preparedstatement.h to use it
+	PreparedStatement prepare(const QString& sql) const;
+	PreparedStatement prepare(const QByteArray& sql) const;
+
 	[[deprecated("use queryCache2 - this one is problematic to use, and with redundant and never used param")]] sqlResult  queryCache(const QString& sql, bool on = false, QString name = QString(), uint ttl = 3600);
 	[[deprecated("use queryCacheLine2 - this one is problematic to use, and with redundant and never used param")]] sqlRow queryCacheLine(const QString& sql, bool on = false, QString name = QString(), uint ttl = 3600, bool required = false);
 
@@ -222,6 +391,15 @@ struct DB {
 	sqlRow queryCacheLine2(const QString& sql, uint ttl = 3600, bool required = false);
 
 	sqlResult queryCache2(const QString& sql, uint ttl);
+	//in process cache in front of the cachedSQL/ files of queryCache2, shared by all the DB
+	static ShardedLRU<QByteArray, sqlResult>& queryCacheL1();
+	//Same as queryCache2 but without the copy, the cell are read lazily from the mmapped file
+	std::shared_ptr<const sqlMappedResult> queryCacheMapped(const QString& sql, uint ttl);
+	//cachedSQL/ policy, checked at most every 5 minutes
+	inline static quint64 cacheDirMaxBytes = 1024 * 1024 * 1024;
+	inline static uint    cacheDirMaxAge   = 7 * 86400;
+	//only if built with MINMYSQL_ZSTD
+	inline static bool cacheCompress = false;
 
 	//This is to be used ONLY in case the query can have deadlock, and internally tries multiple times to insert data
 	sqlResult queryDeadlockRepeater(const QByteArray& sql, uint maxTry = 5) const;
@@ -243,17 +421,29 @@ struct DB {
 			usleep(100);
 		}
 		fetch
+	  or better, co_await queryAsync
 	 * @brief completedQuery
 	 * @return
 	 */
 	bool completedQuery() const;
 
+#if defined(__cpp_impl_coroutine)
+	/**
+	 * @brief queryAsync co_await db.queryAsync(sql), no thread is blocked while waiting (see sqlcoroutine.h)
+	 * runs on a connection of the scheduler (the thread PollScheduler if nullptr), not the one of this DB
+	 */
+	Task<sqlResult> queryAsync(QByteArray sql, CoScheduler* scheduler = nullptr) const;
+	Task<sqlResult> queryAsync(const QString& sql, CoScheduler* scheduler = nullptr) const;
+#endif
+
 	//Shared by both async and not
-	sqlResult getWarning(bool useSuppressionList = true) const;
-	sqlResult fetchResult(SQLLogger* sqlLogger = nullptr) const;
-	int       fetchAdvanced(FetchVisitor* visitor) const;
-	st_mysql* getConn() const;
-	ulong     lastId() const;
+	sqlResult         getWarning(bool useSuppressionList = true) const;
+	sqlResult         fetchResult(SQLLogger* sqlLogger = nullptr) const;
+	sqlColumnarResult fetchColumnar(SQLLogger* sqlLogger = nullptr) const;
+	sqlResultView     fetchView(SQLLogger* sqlLogger = nullptr) const;
+	int               fetchAdvanced(FetchVisitor* visitor) const;
+	st_mysql*         getConn() const;
+	ulong             lastId() const;
 
 	//Non copyable
 	DB& operator=(const DB&) = delete;
@@ -268,30 +458,55 @@ struct DB {
 	void         setConf(const DBConf& value);
 
 	long getAffectedRows() const;
+	//server max_allowed_packet, read once
+	uint maxAllowedPacket() const;
+	//of the connection leased by this thread
+	ConnStats getConnStats() const;
+	//mysql thread id of the connection leased by this thread, 0 if none (will not connect)
+	ulong threadId() const;
 	struct InternalState {
 		//This will hopefully help track down the disconnection issue
 		uint    queryExecuted = 0;
 		uint    reconnection  = 0;
 		bool    NULL_as_EMPTY = false;
 		QString lastError;
+		//created in the current session (upper case, no db), see DB::canCoalesce
+		QSet<QByteArray> temporaryTables;
 	};
 	mutable mi_tls<InternalState> state;
 
       private:
+	friend class PreparedStatement;
+	std::shared_ptr<StmtHandle> getStmt(const QByteArray& sql) const;
+
+	//query without the coalescing check
+	sqlResult queryDirect(const QByteArray& sql) const;
+	//the result does not depend on our session, so can be shared with other
+	bool canCoalesce(const QByteArray& sql) const;
+	void trackTemporary(const QByteArray& sql) const;
+	//send the query and handle the error, false if there is nothing to fetch
+	bool execQuery(const QByteArray& sql, SQLLogger& sqlLogger) const;
+	//affected rows, warning and error check, to be called once the result set has been consumed
+	void afterFetch(st_mysql* conn, SQLLogger* sqlLogger) const;
+
 	bool   confSet = false;
 	DBConf conf;
 	//Mutable is needed for all of them
 	mutable mi_tls<long> affectedRows;
-	//this allow to spam the DB handler around, and do not worry of thread, each thread will create it's own connection!
-	mutable mi_tls<st_mysql*> connPool;
+	//this allow to spam the DB handler around, and do not worry of thread, each thread will lease it's own connection!
+	ConnPool* pool = nullptr;
+	//identify the lease of this DB, expires with it (an address can be reused, this can not while a lease refers to it)
+	std::shared_ptr<char> leaseToken = std::make_shared<char>(0);
+	mutable std::atomic<uint> maxPacket = 0;
+	//true if the warnings of sql have to be fetched, count them in any case
+	bool wantWarnings(const QByteArray& sql, uint count) const;
+	void reportWarnings(const QByteArray& sql, const sqlResult& warnings) const;
+
+	//all the warningSuppression joined in a single pattern, or them one by one if they can not be joined (see DB::setConf)
+	QList<QRegularExpression> warningSuppressors;
 	//used for asyncs
 	mutable mi_tls<int>        signalMask;
 	mutable mi_tls<QByteArray> lastSQL;
-	struct SharedState {
-		std::atomic<uint> busyConnection = 0;
-	};
-
-	static SharedState sharedState;
 };
 
 using MYSQL_ROW = char**;
@@ -311,15 +526,16 @@ quint64    getId(const sqlResult& res);
  * the queries (manually or automatically)
  */
 class SQLBuffering {
-	// https://mariadb.com/kb/en/server-system-variables/#max_allowed_packet in our system is always 16M atm
-	static const uint maxPacket = 16E6;
 	//Set as false in case we are running inside another TRX
 	bool useTRX = true;
 
       public:
-	DB*         conn       = nullptr;
-	uint        bufferSize = 1000;
-	QStringList buffer;
+	DB*  conn       = nullptr;
+	uint bufferSize = 1000;
+	//fraction of the server max_allowed_packet filled before sending
+	double packetFill = 0.9;
+	//already in UTF8, as it will be sent
+	QByteArrayList buffer;
 	/**
 	 * @brief SQLBuffering
 	 * @param _conn
@@ -329,9 +545,27 @@ class SQLBuffering {
 	SQLBuffering() = default;
 	~SQLBuffering();
 	void append(const QString& sql);
+	void append(const QByteArray& sql);
+	void append(const char* sql);
 	void flush();
 	void setUseTRX(bool _useTRX);
 	void clear();
+
+	/**
+	 * @brief enableAsync flush will just hand over the buffer to a background thread (with its own connection) and return
+	 * append / flush block only if maxInFlight buffers are already queued or being written.
+	 * An error of a background write is rethrown by the next append / flush / drain
+	 */
+	void enableAsync(uint maxInFlight = 2);
+	//flush and wait for everything appended so far to be written
+	void              drain();
+	std::future<void> drainAsync();
+
+      private:
+	void write(const QByteArrayList& lines);
+
+	struct AsyncFlusher;
+	std::unique_ptr<AsyncFlusher> flusher;
 };
 
 class Runnable {
@@ -347,9 +581,23 @@ class Runnable {
 	 * @param key
 	 * @param time
 	 * @return true: we can run, false: do not run
+	 * The check and the claim are a single upsert, so two node can not both get true.
+	 * A key known to be still in cool down is answered locally, without going to the DB
+	 * The key is at most 255 char (operationCode is the primary key, the old schema allowed 65000)
 	 */
 	[[nodiscard]] bool runnable(const QString& key, qint64 second);
+	/**
+	 * @brief runnable checks (and claims) all the keys in a single round trip
+	 * @return the keys that can run
+	 */
+	[[nodiscard]] QStringList runnable(const QStringList& keys, qint64 second);
 
       private:
+	QByteArray claimSql(const QString& key, qint64 second, qint64 now) const;
+	bool       coolingDown(const QString& key, qint64 second, qint64 now);
+	void       remember(const QString& key, const sqlStatementResult& res, qint64 second, qint64 now);
+
 	DB db;
+	//last known lastRun of each key while in cool down, it can only be older than the one in the DB
+	ShardedLRU<QString, qint64> lastRun{4 * 1024 * 1024};
 };
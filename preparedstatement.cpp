@@ -0,0 +1,424 @@
+#include "preparedstatement.h"
+#include "connpool.h"
+#include "metrics.h"
+#include "mysql/mysql.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QScopeGuard>
+#include <algorithm>
+#include <cstring>
+
+bool stmtResult::isEmpty() const {
+	return rows.empty();
+}
+
+int stmtResult::columnIndex(const QByteArray& name) const {
+	for (uint i = 0; i < columns.size(); i++) {
+		if (columns[i] == name) {
+			return static_cast<int>(i);
+		}
+	}
+	return -1;
+}
+
+const QVariant& stmtResult::value(uint row, const QByteArray& name) const {
+	auto col = columnIndex(name);
+	if (col < 0) {
+		throw DBException(QSL("missing column %1 in the result set").arg(QString(name)), DBException::SchemaError);
+	}
+	return rows.at(row).at(static_cast<uint>(col));
+}
+
+StmtHandle::StmtHandle(st_mysql_stmt* _stmt, const QByteArray& _sql)
+    : stmt(_stmt), sql(_sql) {
+	paramCount = static_cast<uint>(mysql_stmt_param_count(stmt));
+}
+
+StmtHandle::~StmtHandle() {
+	//is safe even if the connection is already closed, the handle is just detached
+	mysql_stmt_close(stmt);
+}
+
+StmtCache::StmtCache(uint _capacity)
+    : capacity(_capacity) {
+}
+
+std::shared_ptr<StmtHandle> StmtCache::get(st_mysql* _conn, const QByteArray& sql) {
+	//a reconnection (even the silent one of MYSQL_OPT_RECONNECT) invalidate all the statement
+	if (_conn != conn || mysql_thread_id(_conn) != connId) {
+		clear();
+		conn   = _conn;
+		connId = mysql_thread_id(_conn);
+	}
+
+	if (auto iter = index.find(sql); iter != index.end()) {
+		//move in front
+		lru.splice(lru.begin(), lru, iter.value());
+		return *iter.value();
+	}
+
+	MYSQL_STMT* stmt = mysql_stmt_init(conn);
+	if (!stmt) {
+		throw QSL("Impossible to init a prepared statement for %1: %2").arg(QString(sql)).arg(mysql_error(conn));
+	}
+	if (mysql_stmt_prepare(stmt, sql.constData(), static_cast<unsigned long>(sql.size()))) {
+		auto err = QSL("Mysql error preparing %1 \nerror was %2 code: %3").arg(QString(sql)).arg(mysql_stmt_error(stmt)).arg(mysql_stmt_errno(stmt));
+		mysql_stmt_close(stmt);
+		qWarning().noquote() << err << QStacker16();
+		cxaNoStack = true;
+		throw err;
+	}
+	//so we know how big the string buffer must be once the result is stored
+	my_bool trueNonSense = 1;
+	mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &trueNonSense);
+
+	auto entry = std::make_shared<StmtHandle>(stmt, sql);
+	lru.push_front(entry);
+	index.insert(sql, lru.begin());
+	if (lru.size() > capacity) {
+		index.remove(lru.back()->sql);
+		lru.pop_back();
+	}
+	return entry;
+}
+
+void StmtCache::clear() {
+	index.clear();
+	lru.clear();
+	conn   = nullptr;
+	connId = 0;
+}
+
+PreparedStatement::PreparedStatement(const DB* _db, const QByteArray& _sql)
+    : db(_db), sql(_sql) {
+}
+
+PreparedStatement& PreparedStatement::bind(uint pos, const QVariant& value) {
+	if (params.size() <= pos) {
+		params.resize(pos + 1);
+	}
+	params[pos] = value;
+	return *this;
+}
+
+namespace {
+struct ParamBuffer {
+	long long     i = 0;
+	double        d = 0;
+	QByteArray    bytes;
+	MYSQL_TIME    time;
+	unsigned long length = 0;
+};
+
+struct ColumnBuffer {
+	enum Kind {
+		integer,
+		real,
+		date,
+		dateTime,
+		bytes
+	} kind = bytes;
+	long long         i = 0;
+	double            d = 0;
+	MYSQL_TIME        time;
+	std::vector<char> buffer;
+	unsigned long     length = 0;
+	my_bool           isNull = 0;
+	my_bool           error  = 0;
+};
+
+void bindParam(const QVariant& v, MYSQL_BIND& bind, ParamBuffer& buf) {
+	//QVariant::isNull is true also for an empty QString in Qt5, only an invalid QVariant is NULL
+	if (!v.isValid()) {
+		bind.buffer_type = MYSQL_TYPE_NULL;
+		return;
+	}
+	switch (v.userType()) {
+	case QMetaType::Bool:
+	case QMetaType::Int:
+	case QMetaType::Long:
+	case QMetaType::LongLong:
+		buf.i            = v.toLongLong();
+		bind.buffer_type = MYSQL_TYPE_LONGLONG;
+		bind.buffer      = &buf.i;
+		return;
+	case QMetaType::UInt:
+	case QMetaType::ULong:
+	case QMetaType::ULongLong:
+		buf.i            = static_cast<long long>(v.toULongLong());
+		bind.buffer_type = MYSQL_TYPE_LONGLONG;
+		bind.buffer      = &buf.i;
+		bind.is_unsigned = 1;
+		return;
+	case QMetaType::Float:
+	case QMetaType::Double:
+		buf.d            = v.toDouble();
+		bind.buffer_type = MYSQL_TYPE_DOUBLE;
+		bind.buffer      = &buf.d;
+		return;
+	case QMetaType::QDate: {
+		auto date = v.toDate();
+		memset(&buf.time, 0, sizeof(buf.time));
+		buf.time.year      = date.year();
+		buf.time.month     = date.month();
+		buf.time.day       = date.day();
+		buf.time.time_type = MYSQL_TIMESTAMP_DATE;
+		bind.buffer_type   = MYSQL_TYPE_DATE;
+		bind.buffer        = &buf.time;
+		return;
+	}
+	case QMetaType::QDateTime: {
+		//connection is in UTC
+		auto dt   = v.toDateTime().toUTC();
+		auto date = dt.date();
+		auto time = dt.time();
+		memset(&buf.time, 0, sizeof(buf.time));
+		buf.time.year        = date.year();
+		buf.time.month       = date.month();
+		buf.time.day         = date.day();
+		buf.time.hour        = time.hour();
+		buf.time.minute      = time.minute();
+		buf.time.second      = time.second();
+		buf.time.second_part = time.msec() * 1000;
+		buf.time.time_type   = MYSQL_TIMESTAMP_DATETIME;
+		bind.buffer_type     = MYSQL_TYPE_DATETIME;
+		bind.buffer          = &buf.time;
+		return;
+	}
+	case QMetaType::QByteArray:
+		buf.bytes        = v.toByteArray();
+		bind.buffer_type = MYSQL_TYPE_BLOB;
+		break;
+	default:
+		buf.bytes        = v.toString().toUtf8();
+		bind.buffer_type = MYSQL_TYPE_STRING;
+		break;
+	}
+	buf.length         = static_cast<unsigned long>(buf.bytes.size());
+	bind.buffer        = const_cast<char*>(buf.bytes.constData());
+	bind.buffer_length = buf.length;
+	bind.length        = &buf.length;
+}
+
+void bindColumn(const MYSQL_FIELD& field, MYSQL_BIND& bind, ColumnBuffer& buf) {
+	switch (field.type) {
+	case MYSQL_TYPE_TINY:
+	case MYSQL_TYPE_SHORT:
+	case MYSQL_TYPE_LONG:
+	case MYSQL_TYPE_INT24:
+	case MYSQL_TYPE_LONGLONG:
+	case MYSQL_TYPE_YEAR:
+		buf.kind         = ColumnBuffer::integer;
+		bind.buffer_type = MYSQL_TYPE_LONGLONG;
+		bind.buffer      = &buf.i;
+		bind.is_unsigned = (field.flags & UNSIGNED_FLAG) ? 1 : 0;
+		break;
+	case MYSQL_TYPE_FLOAT:
+	case MYSQL_TYPE_DOUBLE:
+		buf.kind         = ColumnBuffer::real;
+		bind.buffer_type = MYSQL_TYPE_DOUBLE;
+		bind.buffer      = &buf.d;
+		break;
+	case MYSQL_TYPE_DATE:
+		buf.kind         = ColumnBuffer::date;
+		bind.buffer_type = MYSQL_TYPE_DATE;
+		bind.buffer      = &buf.time;
+		break;
+	case MYSQL_TYPE_DATETIME:
+	case MYSQL_TYPE_TIMESTAMP:
+		buf.kind         = ColumnBuffer::dateTime;
+		bind.buffer_type = MYSQL_TYPE_DATETIME;
+		bind.buffer      = &buf.time;
+		break;
+	default:
+		//DECIMAL (to keep it exact), TIME (can be > 24h), string and blob
+		buf.kind = ColumnBuffer::bytes;
+		buf.buffer.resize(std::max<unsigned long>(field.max_length, 1));
+		bind.buffer_type   = MYSQL_TYPE_STRING;
+		bind.buffer        = buf.buffer.data();
+		bind.buffer_length = static_cast<unsigned long>(buf.buffer.size());
+		break;
+	}
+	bind.length  = &buf.length;
+	bind.is_null = &buf.isNull;
+	bind.error   = &buf.error;
+}
+
+QVariant toVariant(const MYSQL_BIND& bind, const ColumnBuffer& buf) {
+	if (buf.isNull) {
+		return QVariant();
+	}
+	switch (buf.kind) {
+	case ColumnBuffer::integer:
+		if (bind.is_unsigned) {
+			return QVariant(static_cast<qulonglong>(buf.i));
+		}
+		return QVariant(static_cast<qlonglong>(buf.i));
+	case ColumnBuffer::real:
+		return QVariant(buf.d);
+	case ColumnBuffer::date:
+		return QVariant(QDate(static_cast<int>(buf.time.year), static_cast<int>(buf.time.month), static_cast<int>(buf.time.day)));
+	case ColumnBuffer::dateTime: {
+		QDate date(static_cast<int>(buf.time.year), static_cast<int>(buf.time.month), static_cast<int>(buf.time.day));
+		QTime time(static_cast<int>(buf.time.hour), static_cast<int>(buf.time.minute), static_cast<int>(buf.time.second), static_cast<int>(buf.time.second_part / 1000));
+		return QVariant(QDateTime(date, time, Qt::UTC));
+	}
+	case ColumnBuffer::bytes:
+		return QVariant(QByteArray(buf.buffer.data(), static_cast<int>(buf.length)));
+	}
+	return QVariant();
+}
+
+} // namespace
+
+PreparedStatement& PreparedStatement::execute() {
+	SQLLogger sqlLogger(sql, db->conf.logError, db);
+	sqlLogger.logSql = db->conf.logSql;
+	sqlLogger.stats  = db->conf.queryStats;
+
+	auto conn = db->getConn();
+	db->pingCheck(conn, sqlLogger);
+	//after the ping, so if we reconnected the cache is flushed
+	handle    = db->getStmt(sql);
+	auto stmt = handle->stmt;
+
+	if (params.size() != handle->paramCount) {
+		throw QSL("%1 parameter bound, %2 expected for %3").arg(params.size()).arg(handle->paramCount).arg(QString(sql));
+	}
+
+	std::vector<MYSQL_BIND>  binds(params.size());
+	std::vector<ParamBuffer> buffers(params.size());
+	memset(binds.data(), 0, sizeof(MYSQL_BIND) * binds.size());
+	for (uint i = 0; i < params.size(); i++) {
+		bindParam(params[i], binds[i], buffers[i]);
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+	//in case the previous result was never fetched
+	mysql_stmt_free_result(stmt);
+	bool failed = (!binds.empty() && mysql_stmt_bind_param(stmt, binds.data())) || mysql_stmt_execute(stmt);
+	//store the whole result set, so the connection is free again
+	if (!failed && mysql_stmt_field_count(stmt)) {
+		failed = mysql_stmt_store_result(stmt);
+	}
+	db->state.get().queryExecuted++;
+	DBMetrics::queries().add();
+	DBMetrics::bytesSent().add(sql.size());
+	sqlLogger.serverTime = timer.nsecsElapsed();
+
+	if (failed) {
+		auto error      = mysql_stmt_errno(stmt);
+		DBMetrics::errors(error).add();
+		auto err        = QSL("Mysql error for %1 \nerror was %2 code: %3").arg(QString(sql)).arg(mysql_stmt_error(stmt)).arg(error);
+		sqlLogger.error = err;
+		qWarning().noquote() << err << QStacker16();
+		if (error == 2006 || error == 2013) {
+			//force reconnection (and flush of the statement cache) on the next use
+			db->closeConn();
+		}
+		cxaNoStack = true;
+		throw err;
+	}
+
+	if (auto pooled = ConnPool::leased(db->pool, db->leaseToken.get()); pooled) {
+		pooled->lastActivity = QDateTime::currentMSecsSinceEpoch();
+	}
+	affectedRows = static_cast<ulong>(mysql_stmt_affected_rows(stmt));
+	insertId     = mysql_stmt_insert_id(stmt);
+	if (mysql_stmt_field_count(stmt)) {
+		sqlLogger.rows = mysql_stmt_num_rows(stmt);
+	}
+	return *this;
+}
+
+stmtResult PreparedStatement::fetch() {
+	stmtResult res;
+	if (!handle) {
+		return res;
+	}
+	auto       stmt = handle->stmt;
+	MYSQL_RES* meta = mysql_stmt_result_metadata(stmt);
+	if (!meta) {
+		return res;
+	}
+	auto guard = qScopeGuard([&] {
+		mysql_free_result(meta);
+		mysql_stmt_free_result(stmt);
+	});
+
+	auto         num_fields = mysql_num_fields(meta);
+	MYSQL_FIELD* fields     = mysql_fetch_fields(meta);
+
+	std::vector<MYSQL_BIND>   binds(num_fields);
+	std::vector<ColumnBuffer> buffers(num_fields);
+	memset(binds.data(), 0, sizeof(MYSQL_BIND) * binds.size());
+	res.columns.reserve(num_fields);
+	for (uint i = 0; i < num_fields; i++) {
+		res.columns.emplace_back(fields[i].name);
+		bindColumn(fields[i], binds[i], buffers[i]);
+	}
+	if (mysql_stmt_bind_result(stmt, binds.data())) {
+		throw QSL("Mysql error binding the result of %1 \nerror was %2").arg(QString(sql)).arg(mysql_stmt_error(stmt));
+	}
+
+	res.rows.reserve(static_cast<size_t>(mysql_stmt_num_rows(stmt)));
+	int rc;
+	while ((rc = mysql_stmt_fetch(stmt)) == 0 || rc == MYSQL_DATA_TRUNCATED) {
+		std::vector<QVariant> row;
+		row.reserve(num_fields);
+		bool resized = false;
+		for (uint i = 0; i < num_fields; i++) {
+			auto& buf = buffers[i];
+			//max_length should prevent this, but just in case
+			if (buf.kind == ColumnBuffer::bytes && buf.length > buf.buffer.size()) {
+				buf.buffer.resize(buf.length);
+				binds[i].buffer        = buf.buffer.data();
+				binds[i].buffer_length = buf.length;
+				mysql_stmt_fetch_column(stmt, &binds[i], i, 0);
+				resized = true;
+			}
+			row.push_back(toVariant(binds[i], buf));
+		}
+		res.rows.push_back(std::move(row));
+		//the statement still points to the old (now freed) buffer
+		if (resized && mysql_stmt_bind_result(stmt, binds.data())) {
+			throw QSL("Mysql error binding the result of %1 \nerror was %2").arg(QString(sql)).arg(mysql_stmt_error(stmt));
+		}
+	}
+	if (rc == 1) {
+		auto err = QSL("Mysql error fetching %1 \nerror was %2 code: %3").arg(QString(sql)).arg(mysql_stmt_error(stmt)).arg(mysql_stmt_errno(stmt));
+		qWarning().noquote() << err << QStacker16();
+		cxaNoStack = true;
+		throw err;
+	}
+	return res;
+}
+
+ulong PreparedStatement::getAffectedRows() const {
+	return affectedRows;
+}
+
+quint64 PreparedStatement::lastId() const {
+	return insertId;
+}
+
+PreparedStatement DB::prepare(const QString& sql) const {
+	return prepare(sql.toUtf8());
+}
+
+PreparedStatement DB::prepare(const QByteArray& sql) const {
+	//prepare immediately, so a syntax error is reported here and not on the first execute
+	getStmt(sql);
+	return PreparedStatement(this, sql);
+}
+
+std::shared_ptr<StmtHandle> DB::getStmt(const QByteArray& sql) const {
+	auto conn   = getConn();
+	auto pooled = ConnPool::leased(pool, leaseToken.get());
+	if (!pooled->stmtCache) {
+		pooled->stmtCache = std::make_unique<StmtCache>(conf.stmtCacheSize);
+	}
+	return pooled->stmtCache->get(conn, sql);
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "min_mysql.h"
+#include <QHash>
+#include <QVariant>
+#include <list>
+#include <memory>
+
+struct st_mysql_stmt;
+
+/**
+ * @brief The stmtResult struct is the result of a prepared statement
+ * Binary protocol, so each cell is already in his native type (qint64, quint64, double, QDate, QDateTime, QByteArray)
+ * NULL is an invalid (null) QVariant
+ */
+struct stmtResult {
+	std::vector<QByteArray>            columns;
+	std::vector<std::vector<QVariant>> rows;
+
+	bool isEmpty() const;
+	//-1 if not found
+	int columnIndex(const QByteArray& name) const;
+	//throw if the column is not there
+	const QVariant& value(uint row, const QByteArray& name) const;
+};
+
+/**
+ * @brief The StmtHandle struct own a MYSQL_STMT, closed when the last user let it go
+ */
+struct StmtHandle {
+	StmtHandle(st_mysql_stmt* _stmt, const QByteArray& _sql);
+	~StmtHandle();
+	st_mysql_stmt*   stmt = nullptr;
+	const QByteArray sql;
+	uint             paramCount = 0;
+};
+
+/**
+ * @brief The StmtCache class is a LRU of the prepared statement of a single connection, keyed by the SQL text
+ * It remember for which connection it was filled, and just flush itself if that changed (reconnection)
+ */
+class StmtCache {
+      public:
+	StmtCache(uint _capacity);
+	std::shared_ptr<StmtHandle> get(st_mysql* conn, const QByteArray& sql);
+	void                        clear();
+
+      private:
+	using Entry = std::shared_ptr<StmtHandle>;
+	uint                                          capacity = 64;
+	st_mysql*                                     conn     = nullptr;
+	ulong                                         connId   = 0;
+	std::list<Entry>                              lru;
+	QHash<QByteArray, std::list<Entry>::iterator> index;
+};
+
+/**
+ * @brief The PreparedStatement class
+	auto stmt = db.prepare("SELECT id, name FROM user WHERE id = ?");
+	auto res  = stmt.execute(5).fetch();
+
+ * The MYSQL_STMT is looked up in the per connection cache on each execute, so the object survive a reconnection
+ * Is bound to the thread that uses it, exactly as the connection of DB
+ */
+class PreparedStatement {
+      public:
+	PreparedStatement(const DB* _db, const QByteArray& _sql);
+
+	PreparedStatement& bind(uint pos, const QVariant& value);
+
+	template <typename... Args>
+	PreparedStatement& bindAll(const Args&... args) {
+		uint pos = 0;
+		(bind(pos++, toVariant(args)), ...);
+		return *this;
+	}
+
+	PreparedStatement& execute();
+
+	template <typename... Args>
+	PreparedStatement& execute(const Args&... args) {
+		bindAll(args...);
+		return execute();
+	}
+
+	//the result of the last execute, if any
+	stmtResult fetch();
+
+	ulong   getAffectedRows() const;
+	quint64 lastId() const;
+
+	template <typename T>
+	static QVariant toVariant(const T& v) {
+		if constexpr (std::is_same_v<T, std::nullptr_t>) {
+			return QVariant();
+		} else if constexpr (std::is_same_v<T, bool>) {
+			return QVariant(v);
+		} else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+			return QVariant(static_cast<qlonglong>(v));
+		} else if constexpr (std::is_integral_v<T>) {
+			return QVariant(static_cast<qulonglong>(v));
+		} else {
+			return QVariant(v);
+		}
+	}
+
+      private:
+	const DB*                   db = nullptr;
+	QByteArray                  sql;
+	std::vector<QVariant>       params;
+	std::shared_ptr<StmtHandle> handle;
+	ulong                       affectedRows = 0;
+	quint64                     insertId     = 0;
+};
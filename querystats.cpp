@@ -0,0 +1,299 @@
+#include "querystats.h"
+#include <QHash>
+#include <algorithm>
+#include <cctype>
+#include <memory>
+#include <shared_mutex>
+
+namespace {
+struct Registry {
+	std::shared_mutex                                mutex;
+	QHash<quint64, QueryStats::Digest*>              byDigest;
+	std::vector<std::unique_ptr<QueryStats::Digest>> digests;
+};
+
+Registry& registry() {
+	static Registry r;
+	return r;
+}
+
+//digest are never deleted, so a thread can keep the pointer
+thread_local QHash<quint64, QueryStats::Digest*> localDigests;
+
+QueryStats::Digest* findOrCreate(quint64 digest, const QByteArray& fingerprint) {
+	if (auto d = localDigests.value(digest); d) {
+		return d;
+	}
+	auto&               r     = registry();
+	QueryStats::Digest* found = nullptr;
+	{
+		std::shared_lock<std::shared_mutex> lock(r.mutex);
+		found = r.byDigest.value(digest);
+	}
+	if (!found) {
+		std::unique_lock<std::shared_mutex> lock(r.mutex);
+		auto                                key = digest;
+		auto                                fp  = fingerprint;
+		if (!r.byDigest.contains(key) && r.digests.size() >= QueryStats::maxDigests) {
+			fp  = "other";
+			key = QueryStats::digestOf(fp);
+		}
+		found = r.byDigest.value(key);
+		if (!found) {
+			r.digests.push_back(std::make_unique<QueryStats::Digest>());
+			found              = r.digests.back().get();
+			found->fingerprint = fp;
+			r.byDigest.insert(key, found);
+		}
+	}
+	localDigests.insert(digest, found);
+	return found;
+}
+
+bool isIdent(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '$';
+}
+
+bool isDigit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+//a, b, c -> a, until nothing changes
+void collapse(QByteArray& out, const QByteArray& repeated, const QByteArray& single) {
+	while (out.contains(repeated)) {
+		out.replace(repeated, single);
+	}
+}
+} // namespace
+
+void LatencyHistogram::record(quint64 value) {
+	counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(value, std::memory_order_relaxed);
+	auto current = max.load(std::memory_order_relaxed);
+	while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+	}
+}
+
+LatencyHistogram::Summary LatencyHistogram::summary() const {
+	Summary              s;
+	std::vector<quint64> snap(buckets);
+	for (uint i = 0; i < buckets; i++) {
+		snap[i] = counts[i].load(std::memory_order_relaxed);
+		s.count += snap[i];
+	}
+	if (!s.count) {
+		return s;
+	}
+	s.max  = max.load(std::memory_order_relaxed);
+	s.mean = static_cast<double>(sum.load(std::memory_order_relaxed)) / s.count;
+	s.p50  = percentile(snap, s.count, 0.5);
+	s.p99  = percentile(snap, s.count, 0.99);
+	s.p999 = percentile(snap, s.count, 0.999);
+	return s;
+}
+
+void LatencyHistogram::reset() {
+	for (auto& c : counts) {
+		c.store(0, std::memory_order_relaxed);
+	}
+	sum.store(0, std::memory_order_relaxed);
+	max.store(0, std::memory_order_relaxed);
+}
+
+uint LatencyHistogram::bucketOf(quint64 value) {
+	if (value < subBuckets) {
+		return static_cast<uint>(value);
+	}
+	uint msb = 63 - static_cast<uint>(__builtin_clzll(value));
+	if (msb >= maxBits) {
+		return buckets - 1;
+	}
+	uint shift = msb - subBits;
+	return (shift + 1) * subBuckets + static_cast<uint>((value >> shift) & (subBuckets - 1));
+}
+
+quint64 LatencyHistogram::bucketValue(uint bucket) {
+	if (bucket < subBuckets) {
+		return bucket;
+	}
+	uint    shift = bucket / subBuckets - 1;
+	quint64 lower = static_cast<quint64>(subBuckets + bucket % subBuckets) << shift;
+	//middle of the bucket
+	return lower + ((1ULL << shift) >> 1);
+}
+
+quint64 LatencyHistogram::percentile(const std::vector<quint64>& snap, quint64 total, double p) const {
+	auto    rank = static_cast<quint64>(p * total);
+	quint64 seen = 0;
+	for (uint i = 0; i < buckets; i++) {
+		seen += snap[i];
+		if (seen > rank) {
+			//never report more than what was really seen
+			return std::min(bucketValue(i), max.load(std::memory_order_relaxed));
+		}
+	}
+	return max.load(std::memory_order_relaxed);
+}
+
+QByteArray QueryStats::fingerprint(const QByteArray& sql) {
+	QByteArray out;
+	out.reserve(sql.size());
+	bool space = false;
+	auto put   = [&](char c) {
+		//no space around , and inside ( ), so (1, 2) and (1,2) are the same
+		if (space && !out.isEmpty() && c != ',' && c != ')' && !out.endsWith(',') && !out.endsWith('(')) {
+			out.append(' ');
+		}
+		space = false;
+		out.append(c);
+	};
+
+	int size = sql.size();
+	for (int i = 0; i < size; i++) {
+		char c = sql[i];
+		if (isSpace(c)) {
+			space = true;
+			continue;
+		}
+		//comment
+		if (c == '#' || (c == '-' && i + 2 < size && sql[i + 1] == '-' && isSpace(sql[i + 2]))) {
+			while (i < size && sql[i] != '\n') {
+				i++;
+			}
+			space = true;
+			continue;
+		}
+		if (c == '/' && i + 1 < size && sql[i + 1] == '*') {
+			auto end = sql.indexOf("*/", i + 2);
+			i        = end < 0 ? size : end + 1;
+			space    = true;
+			continue;
+		}
+		//string literal
+		if (c == '\'' || c == '"') {
+			for (i++; i < size; i++) {
+				if (sql[i] == '\\') {
+					i++;
+				} else if (sql[i] == c) {
+					//'' is an escaped quote
+					if (i + 1 < size && sql[i + 1] == c) {
+						i++;
+					} else {
+						break;
+					}
+				}
+			}
+			put('?');
+			continue;
+		}
+		//quoted identifier, kept as is
+		if (c == '`') {
+			put(c);
+			for (i++; i < size && sql[i] != '`'; i++) {
+				out.append(sql[i]);
+			}
+			out.append('`');
+			continue;
+		}
+		//number, unless is part of an identifier like table1
+		if ((isDigit(c) || (c == '.' && i + 1 < size && isDigit(sql[i + 1]))) && !(!out.isEmpty() && isIdent(out.at(out.size() - 1)) && !space)) {
+			if (c == '0' && i + 1 < size && (sql[i + 1] == 'x' || sql[i + 1] == 'X')) {
+				i += 2;
+				while (i < size && isxdigit(static_cast<uchar>(sql[i]))) {
+					i++;
+				}
+			} else {
+				while (i < size && (isDigit(sql[i]) || sql[i] == '.')) {
+					i++;
+				}
+				if (i + 1 < size && (sql[i] == 'e' || sql[i] == 'E') && (isDigit(sql[i + 1]) || sql[i + 1] == '-' || sql[i + 1] == '+')) {
+					i += 2;
+					while (i < size && isDigit(sql[i])) {
+						i++;
+					}
+				}
+			}
+			i--;
+			//a negative number is a single value, x - 1 is not
+			if (out.endsWith('-') && !space) {
+				auto prev = out.size() > 1 ? out.at(out.size() - 2) : '(';
+				if (prev == ' ' && out.size() > 2) {
+					prev = out.at(out.size() - 3);
+				}
+				if (prev == '(' || prev == ',' || prev == '=' || prev == '<' || prev == '>') {
+					out.chop(1);
+				}
+			}
+			put('?');
+			continue;
+		}
+		put(static_cast<char>(toupper(static_cast<uchar>(c))));
+	}
+	while (out.endsWith(';') || out.endsWith(' ')) {
+		out.chop(1);
+	}
+
+	out.replace("FROM_BASE64(?)", "?");
+	collapse(out, "?,?", "?");
+	collapse(out, "(?),(?)", "(?)");
+	return out;
+}
+
+quint64 QueryStats::digestOf(const QByteArray& fingerprint) {
+	//FNV-1a
+	quint64 h = 14695981039346656037ULL;
+	for (auto c : fingerprint) {
+		h ^= static_cast<uchar>(c);
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+void QueryStats::record(const QByteArray& sql, qint64 serverTime, qint64 fetchTime, quint64 rows, quint64 bytes) {
+	auto fp = fingerprint(sql);
+	auto d  = findOrCreate(digestOf(fp), fp);
+	d->serverTime.record(static_cast<quint64>(std::max<qint64>(serverTime, 0)));
+	d->fetchTime.record(static_cast<quint64>(std::max<qint64>(fetchTime, 0)));
+	d->rows.record(rows);
+	d->bytes.record(bytes);
+}
+
+std::vector<QueryStats::Snapshot> QueryStats::snapshot() {
+	std::vector<Snapshot> res;
+	auto&                 r = registry();
+	{
+		std::shared_lock<std::shared_mutex> lock(r.mutex);
+		res.reserve(r.digests.size());
+		for (auto& d : r.digests) {
+			Snapshot s;
+			s.fingerprint = d->fingerprint;
+			s.digest      = digestOf(d->fingerprint);
+			s.serverTime  = d->serverTime.summary();
+			s.fetchTime   = d->fetchTime.summary();
+			s.rows        = d->rows.summary();
+			s.bytes       = d->bytes.summary();
+			if (s.serverTime.count) {
+				res.push_back(s);
+			}
+		}
+	}
+	std::sort(res.begin(), res.end(), [](const Snapshot& a, const Snapshot& b) {
+		return a.serverTime.mean * a.serverTime.count > b.serverTime.mean * b.serverTime.count;
+	});
+	return res;
+}
+
+void QueryStats::reset() {
+	auto&                               r = registry();
+	std::shared_lock<std::shared_mutex> lock(r.mutex);
+	for (auto& d : r.digests) {
+		d->serverTime.reset();
+		d->fetchTime.reset();
+		d->rows.reset();
+		d->bytes.reset();
+	}
+}
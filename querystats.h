@@ -0,0 +1,82 @@
+#pragma once
+
+#include <QByteArray>
+#include <atomic>
+#include <vector>
+
+/**
+ * @brief The LatencyHistogram class is a log linear (HDR style) histogram, 8 sub bucket per power of 2 so ~12% precision
+ * up to 2^40 (18 minutes in ns, 1TB in byte), bigger value are counted in the last bucket (max is still exact).
+ * record is a relaxed atomic increment, no lock. 304 bucket, ~2.4KB each
+ */
+class LatencyHistogram {
+      public:
+	static constexpr uint subBits    = 3;
+	static constexpr uint maxBits    = 40;
+	static constexpr uint subBuckets = 1 << subBits;
+	static constexpr uint buckets    = (maxBits - subBits + 1) * subBuckets;
+
+	struct Summary {
+		quint64 count = 0;
+		quint64 max   = 0;
+		double  mean  = 0;
+		quint64 p50   = 0;
+		quint64 p99   = 0;
+		quint64 p999  = 0;
+	};
+
+	void    record(quint64 value);
+	Summary summary() const;
+	void    reset();
+
+	static uint    bucketOf(quint64 value);
+	static quint64 bucketValue(uint bucket);
+
+      private:
+	quint64 percentile(const std::vector<quint64>& counts, quint64 total, double p) const;
+
+	std::atomic<quint64> counts[buckets] = {};
+	std::atomic<quint64> sum{0};
+	std::atomic<quint64> max{0};
+};
+
+/**
+ * @brief The QueryStats class aggregates the query by fingerprint (the statement without literal, see fingerprint),
+ * enable with DBConf::queryStats
+ */
+class QueryStats {
+      public:
+	struct Digest {
+		QByteArray       fingerprint;
+		LatencyHistogram serverTime; //ns
+		LatencyHistogram fetchTime;  //ns
+		LatencyHistogram rows;
+		LatencyHistogram bytes;
+	};
+
+	struct Snapshot {
+		QByteArray                fingerprint;
+		quint64                   digest = 0;
+		LatencyHistogram::Summary serverTime;
+		LatencyHistogram::Summary fetchTime;
+		LatencyHistogram::Summary rows;
+		LatencyHistogram::Summary bytes;
+	};
+
+	//past this many distinct fingerprint, the new one are accounted as "other"
+	//each Digest holds 4 LatencyHistogram, ~10KB, so the default can pin ~20MB
+	inline static uint maxDigests = 2000;
+
+	/**
+	 * @brief fingerprint normalize a statement: comment and redundant whitespace removed, uppercase outside quote,
+	 * string, number and FROM_BASE64('...') become ?, list of ? (IN list, VALUES row) collapse in a single ?
+	 */
+	static QByteArray fingerprint(const QByteArray& sql);
+	static quint64    digestOf(const QByteArray& fingerprint);
+
+	static void record(const QByteArray& sql, qint64 serverTime, qint64 fetchTime, quint64 rows, quint64 bytes);
+	//sorted by total server time, the most expensive first
+	static std::vector<Snapshot> snapshot();
+	//zero all the counter, the fingerprint are kept
+	static void reset();
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <QHash>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+
+/**
+ * @brief The SingleFlight class coalesces identical concurrent calls
+ * the first caller for a key runs the function, the callers arriving while it runs wait and share the same
+ * (immutable) result, or get the same exception. Once it is over the next caller runs it again, nothing is cached.
+ */
+template <typename K, typename V>
+class SingleFlight {
+      public:
+	using Result = std::shared_ptr<const V>;
+
+	/**
+	 * @param leader if not null, set to true if this call executed fn
+	 */
+	template <typename Fn>
+	Result run(const K& key, Fn&& fn, bool* leader = nullptr) {
+		std::promise<Result> promise;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (auto iter = inFlight.find(key); iter != inFlight.end()) {
+				auto future = iter.value();
+				lock.unlock();
+				coalesced++;
+				if (leader) {
+					*leader = false;
+				}
+				//rethrows the leader exception
+				return future.get();
+			}
+			inFlight.insert(key, promise.get_future().share());
+		}
+		if (leader) {
+			*leader = true;
+		}
+
+		try {
+			Result res = std::make_shared<const V>(fn());
+			forget(key);
+			promise.set_value(res);
+			return res;
+		} catch (...) {
+			forget(key);
+			promise.set_exception(std::current_exception());
+			throw;
+		}
+	}
+
+	//how many call got the result of another one
+	quint64 getCoalesced() const {
+		return coalesced;
+	}
+
+      private:
+	void forget(const K& key) {
+		std::lock_guard<std::mutex> guard(mutex);
+		inFlight.remove(key);
+	}
+
+	std::mutex                           mutex;
+	QHash<K, std::shared_future<Result>> inFlight;
+	std::atomic<quint64>                 coalesced{0};
+};
@@ -0,0 +1,363 @@
+#include "sqlcachefile.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef MINMYSQL_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+struct Header {
+	char    magic[4];
+	quint32 version;
+	quint32 flags;
+	quint32 colCount;
+	quint32 rowCount;
+	quint32 reserved;
+	qint64  createdAt;   //seconds since epoch
+	quint64 namesSize;   //padded
+	quint64 payloadSize; //decoded
+	quint64 storedSize;  //as in the file
+};
+
+constexpr char    magic[4] = {'M', 'S', 'Q', 'C'};
+constexpr quint32 version  = 1;
+constexpr quint32 zstdFlag = 1;
+//a QByteArray can not be bigger anyway
+constexpr quint64 maxDecoded = 1ULL << 30;
+
+quint64 pad(quint64 v, quint64 to) {
+	return (v + to - 1) / to * to;
+}
+} // namespace
+
+sqlMappedRow::sqlMappedRow(const sqlMappedResult* _res, uint _row)
+    : res(_res), row(_row) {
+}
+
+std::string_view sqlMappedRow::at(uint col) const {
+	return res->cell(row, col);
+}
+
+std::string_view sqlMappedRow::at(const QByteArray& key) const {
+	auto col = res->columnIndex(key);
+	if (col < 0) {
+		throw DBException(QSL("missing column %1 in the result set").arg(QString(key)), DBException::SchemaError);
+	}
+	return res->cell(row, static_cast<uint>(col));
+}
+
+bool sqlMappedRow::isNull(uint col) const {
+	return res->isNull(row, col);
+}
+
+bool sqlMappedRow::contains(const QByteArray& key) const {
+	return res->columnIndex(key) >= 0;
+}
+
+sqlRow sqlMappedRow::toSqlRow() const {
+	sqlRow r;
+	for (uint c = 0; c < res->colCount(); c++) {
+		auto v = res->cell(row, c);
+		r.insert(res->columns[c], QByteArray(v.data(), static_cast<int>(v.size())));
+	}
+	return r;
+}
+
+sqlMappedResult::~sqlMappedResult() {
+	if (map) {
+		munmap(const_cast<char*>(map), static_cast<size_t>(mapSize));
+	}
+}
+
+std::shared_ptr<const sqlMappedResult> sqlMappedResult::open(const QString& path) {
+	int fd = ::open(path.toLocal8Bit().constData(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return nullptr;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < static_cast<off_t>(sizeof(Header))) {
+		::close(fd);
+		return nullptr;
+	}
+	auto map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	//the mapping stays valid after the close
+	::close(fd);
+	if (map == MAP_FAILED) {
+		return nullptr;
+	}
+
+	std::shared_ptr<sqlMappedResult> res(new sqlMappedResult());
+	res->map     = static_cast<const char*>(map);
+	res->mapSize = st.st_size;
+	if (!res->parse()) {
+		qWarning().noquote() << "invalid cached result file" << path;
+		return nullptr;
+	}
+	return res;
+}
+
+bool sqlMappedResult::parse() {
+	Header h;
+	memcpy(&h, map, sizeof(h));
+	if (memcmp(h.magic, magic, sizeof(magic)) || h.version != version) {
+		return false;
+	}
+	//each one alone first, so a corrupted size can not wrap the sum
+	auto fileSize = static_cast<quint64>(mapSize);
+	if (h.namesSize > fileSize || h.storedSize > fileSize || fileSize != sizeof(Header) + h.namesSize + h.storedSize) {
+		//truncated
+		return false;
+	}
+	createdAt = h.createdAt;
+	rows      = h.rowCount;
+
+	auto names    = map + sizeof(Header);
+	auto namesEnd = names + h.namesSize;
+	for (uint c = 0; c < h.colCount; c++) {
+		if (names + sizeof(quint32) > namesEnd) {
+			return false;
+		}
+		auto len = qFromUnaligned<quint32>(names);
+		names += sizeof(quint32);
+		if (len > static_cast<quint64>(namesEnd - names)) {
+			return false;
+		}
+		columns.emplace_back(names, static_cast<int>(len));
+		names += len;
+	}
+
+	const char* payload = namesEnd;
+	if (h.flags & zstdFlag) {
+#ifdef MINMYSQL_ZSTD
+		//the frame must agree with the header, and a hostile header must not force a huge allocation
+		auto frameSize = ZSTD_getFrameContentSize(payload, h.storedSize);
+		if (h.payloadSize > maxDecoded || frameSize != h.payloadSize) {
+			return false;
+		}
+		decoded.resize(static_cast<int>(h.payloadSize));
+		auto size = ZSTD_decompress(decoded.data(), h.payloadSize, payload, h.storedSize);
+		if (ZSTD_isError(size) || size != h.payloadSize) {
+			return false;
+		}
+		payload = decoded.constData();
+#else
+		qWarning() << "cached result is zstd compressed, but the support is not compiled in (MINMYSQL_ZSTD)";
+		return false;
+#endif
+	} else if (h.payloadSize != h.storedSize) {
+		return false;
+	}
+
+	quint64 cells = static_cast<quint64>(rows) * columns.size();
+	//each cell takes at least its offset, also keeps the size math below from overflowing
+	if (cells > h.payloadSize) {
+		return false;
+	}
+	quint64 nullBytes = pad((cells + 7) / 8, 4);
+	quint64 offBytes  = (cells + 1) * sizeof(quint32);
+	if (nullBytes + offBytes > h.payloadSize) {
+		return false;
+	}
+	nullMap = reinterpret_cast<const uchar*>(payload);
+	offsets = payload + nullBytes;
+	arena   = offsets + offBytes;
+	//the last offset is the arena size
+	quint64 arenaSize = qFromUnaligned<quint32>(offsets + cells * sizeof(quint32));
+	if (nullBytes + offBytes + arenaSize != h.payloadSize) {
+		return false;
+	}
+	//cell() trusts them, so a corrupted file must not point outside the arena
+	quint32 prev = 0;
+	for (quint64 i = 0; i <= cells; i++) {
+		auto off = qFromUnaligned<quint32>(offsets + i * sizeof(quint32));
+		if (off < prev || off > arenaSize || (i == 0 && off != 0)) {
+			return false;
+		}
+		prev = off;
+	}
+	return true;
+}
+
+bool sqlMappedResult::write(const QString& path, const sqlResult& res, bool compress) {
+	//union of the keys, in order of first appearance (usually all the row have the same)
+	std::vector<QByteArray> columns;
+	for (auto& row : res) {
+		for (auto iter = row.begin(); iter != row.end(); ++iter) {
+			if (std::find(columns.begin(), columns.end(), iter.key()) == columns.end()) {
+				columns.push_back(iter.key());
+			}
+		}
+	}
+
+	QByteArray names;
+	for (auto& col : columns) {
+		quint32 len = static_cast<quint32>(col.size());
+		names.append(reinterpret_cast<const char*>(&len), sizeof(len));
+		names.append(col);
+	}
+	names.append(QByteArray(static_cast<int>(pad(names.size(), 8) - names.size()), '\0'));
+
+	quint64              cells = static_cast<quint64>(res.size()) * columns.size();
+	QByteArray           nullMap(static_cast<int>(pad((cells + 7) / 8, 4)), '\0');
+	std::vector<quint32> offsets;
+	offsets.reserve(cells + 1);
+	offsets.push_back(0);
+	QByteArray arena;
+	quint64    cell = 0;
+	for (auto& row : res) {
+		for (auto& col : columns) {
+			auto iter = row.constFind(col);
+			if (iter == row.constEnd() || iter.value() == BSQL_NULL) {
+				nullMap[static_cast<int>(cell / 8)] = static_cast<char>(nullMap[static_cast<int>(cell / 8)] | (1 << (cell % 8)));
+			} else {
+				arena.append(iter.value());
+				if (static_cast<quint64>(arena.size()) > std::numeric_limits<quint32>::max()) {
+					qWarning() << "result too big to be cached" << path;
+					return false;
+				}
+			}
+			offsets.push_back(static_cast<quint32>(arena.size()));
+			cell++;
+		}
+	}
+
+	QByteArray payload = nullMap;
+	payload.append(reinterpret_cast<const char*>(offsets.data()), static_cast<int>(offsets.size() * sizeof(quint32)));
+	payload.append(arena);
+
+	Header h;
+	memcpy(h.magic, magic, sizeof(magic));
+	h.version     = version;
+	h.flags       = 0;
+	h.colCount    = static_cast<quint32>(columns.size());
+	h.rowCount    = static_cast<quint32>(res.size());
+	h.reserved    = 0;
+	h.createdAt   = QDateTime::currentSecsSinceEpoch();
+	h.namesSize   = static_cast<quint64>(names.size());
+	h.payloadSize = static_cast<quint64>(payload.size());
+
+#ifdef MINMYSQL_ZSTD
+	if (compress) {
+		QByteArray packed(static_cast<int>(ZSTD_compressBound(payload.size())), Qt::Uninitialized);
+		auto       size = ZSTD_compress(packed.data(), packed.size(), payload.constData(), payload.size(), 3);
+		//not worth it for tiny or incompressible one
+		if (!ZSTD_isError(size) && size < static_cast<size_t>(payload.size()) * 0.9) {
+			packed.resize(static_cast<int>(size));
+			payload = packed;
+			h.flags |= zstdFlag;
+		}
+	}
+#else
+	(void)compress;
+#endif
+	h.storedSize = static_cast<quint64>(payload.size());
+
+	QSaveFile file(path);
+	if (!file.open(QIODevice::WriteOnly)) {
+		qWarning().noquote() << "impossible to write the cached result" << path << file.errorString();
+		return false;
+	}
+	file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	file.write(names);
+	file.write(payload);
+	return file.commit();
+}
+
+uint sqlMappedResult::maintain(const QString& dir, quint64 maxBytes, uint maxAge) {
+	QDir d(dir);
+	auto files   = d.entryInfoList(QDir::Files, QDir::Time | QDir::Reversed); //oldest first
+	auto now     = QDateTime::currentDateTimeUtc();
+	uint removed = 0;
+
+	quint64          total = 0;
+	QList<QFileInfo> kept;
+	for (auto& info : files) {
+		auto age = info.lastModified().secsTo(now);
+		//the leftover of a crashed QSaveFile, or a file in the old QDataStream format
+		bool leftover = !info.fileName().endsWith(QSL(".mmc")) && age > 3600;
+		if ((maxAge && age > maxAge) || leftover) {
+			if (QFile::remove(info.absoluteFilePath())) {
+				removed++;
+			}
+			continue;
+		}
+		total += static_cast<quint64>(info.size());
+		kept.append(info);
+	}
+	for (auto& info : kept) {
+		if (!maxBytes || total <= maxBytes) {
+			break;
+		}
+		if (QFile::remove(info.absoluteFilePath())) {
+			total -= static_cast<quint64>(info.size());
+			removed++;
+		}
+	}
+	return removed;
+}
+
+uint sqlMappedResult::rowCount() const {
+	return rows;
+}
+
+uint sqlMappedResult::colCount() const {
+	return static_cast<uint>(columns.size());
+}
+
+bool sqlMappedResult::isEmpty() const {
+	return rows == 0;
+}
+
+qint64 sqlMappedResult::getCreatedAt() const {
+	return createdAt;
+}
+
+int sqlMappedResult::columnIndex(const QByteArray& name) const {
+	for (uint c = 0; c < columns.size(); c++) {
+		if (columns[c] == name) {
+			return static_cast<int>(c);
+		}
+	}
+	return -1;
+}
+
+std::string_view sqlMappedResult::cell(uint row, uint col) const {
+	if (isNull(row, col)) {
+		return std::string_view(BSQL_NULL.constData(), static_cast<size_t>(BSQL_NULL.size()));
+	}
+	quint64 idx   = static_cast<quint64>(row) * columns.size() + col;
+	auto    begin = qFromUnaligned<quint32>(offsets + idx * sizeof(quint32));
+	auto    end   = qFromUnaligned<quint32>(offsets + (idx + 1) * sizeof(quint32));
+	return std::string_view(arena + begin, end - begin);
+}
+
+bool sqlMappedResult::isNull(uint row, uint col) const {
+	quint64 idx = static_cast<quint64>(row) * columns.size() + col;
+	return nullMap[idx / 8] & (1 << (idx % 8));
+}
+
+sqlMappedRow sqlMappedResult::row(uint row) const {
+	return sqlMappedRow(this, row);
+}
+
+sqlResult sqlMappedResult::toSqlResult() const {
+	sqlResult res;
+	res.reserve(static_cast<int>(rows));
+	for (uint r = 0; r < rows; r++) {
+		res.append(row(r).toSqlRow());
+	}
+	return res;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "sqlcolumnar.h"
+#include <memory>
+#include <string_view>
+
+class sqlMappedResult;
+
+/**
+ * @brief The sqlMappedRow class is a cheap handle to a row of a sqlMappedResult, same accessor of sqlRow
+ */
+class sqlMappedRow : public sqlRowAccess<sqlMappedRow> {
+      public:
+	sqlMappedRow(const sqlMappedResult* _res, uint _row);
+
+	std::string_view at(uint col) const;
+	std::string_view at(const QByteArray& key) const;
+	bool             isNull(uint col) const;
+	bool             contains(const QByteArray& key) const;
+
+	sqlRow toSqlRow() const;
+
+      private:
+	const sqlMappedResult* res = nullptr;
+	uint                   row = 0;
+};
+
+/**
+ * @brief The sqlMappedResult class is a result set stored in the cachedSQL/ binary format, read through mmap
+ * Nothing is decoded on open, a cell is a string_view inside the mapping (or inside the decompressed block if the file is compressed).
+ *
+ * Layout (native endian):
+ * header | column names (u32 len + bytes, padded to 8) | payload
+ * payload (optionally a single zstd frame) = null bitmap (padded to 4) | u32 offsets [cells + 1] | cell arena
+ * a NULL is stored as null, and read back as BSQL_NULL (as sqlRow does)
+ */
+class sqlMappedResult {
+      public:
+	~sqlMappedResult();
+	sqlMappedResult(const sqlMappedResult&) = delete;
+	sqlMappedResult& operator=(const sqlMappedResult&) = delete;
+
+	//nullptr if missing, truncated or not in this format
+	static std::shared_ptr<const sqlMappedResult> open(const QString& path);
+	//written in a temp file and renamed, so a reader never sees half a file. compress is ignored if built without MINMYSQL_ZSTD
+	static bool write(const QString& path, const sqlResult& res, bool compress = false);
+
+	/**
+	 * @brief maintain the cachedSQL/ directory: drop the file older than maxAge (seconds) and the leftover of a failed write,
+	 * then the least recently written until the total is below maxBytes (0 = no limit)
+	 * @return the number of removed file
+	 */
+	static uint maintain(const QString& dir, quint64 maxBytes, uint maxAge);
+
+	uint   rowCount() const;
+	uint   colCount() const;
+	bool   isEmpty() const;
+	qint64 getCreatedAt() const;
+	int    columnIndex(const QByteArray& name) const;
+
+	std::string_view cell(uint row, uint col) const;
+	bool             isNull(uint row, uint col) const;
+	sqlMappedRow     row(uint row) const;
+
+	sqlResult toSqlResult() const;
+
+      private:
+	sqlMappedResult() = default;
+	bool parse();
+
+	const char* map     = nullptr;
+	qint64      mapSize = 0;
+	//used only if the payload is compressed
+	QByteArray decoded;
+
+	qint64                  createdAt = 0;
+	uint                    rows      = 0;
+	std::vector<QByteArray> columns;
+	const uchar*            nullMap = nullptr;
+	const char*             offsets = nullptr; //u32 array, read with qFromUnaligned
+	const char*             arena   = nullptr;
+};
@@ -0,0 +1,202 @@
+#include "sqlcolumnar.h"
+#include "sqltrace.h"
+#include "mysql/mysql.h"
+#include <QElapsedTimer>
+#include <QScopeGuard>
+#include <limits>
+
+sqlColumnarRow::sqlColumnarRow(const sqlColumnarResult* _res, uint _row)
+    : res(_res), row(_row) {
+}
+
+std::string_view sqlColumnarRow::at(uint col) const {
+	return res->cell(row, col);
+}
+
+std::string_view sqlColumnarRow::at(const QByteArray& key) const {
+	auto col = res->columnIndex(key);
+	if (col < 0) {
+		throw DBException(QSL("missing column %1 in the result set").arg(QString(key)), DBException::SchemaError);
+	}
+	return res->cell(row, static_cast<uint>(col));
+}
+
+bool sqlColumnarRow::isNull(uint col) const {
+	return res->isNull(row, col);
+}
+
+bool sqlColumnarRow::isNull(const QByteArray& key) const {
+	auto col = res->columnIndex(key);
+	if (col < 0) {
+		throw DBException(QSL("missing column %1 in the result set").arg(QString(key)), DBException::SchemaError);
+	}
+	return res->isNull(row, static_cast<uint>(col));
+}
+
+bool sqlColumnarRow::contains(const QByteArray& key) const {
+	return res->columnIndex(key) >= 0;
+}
+
+sqlRow sqlColumnarRow::toSqlRow() const {
+	sqlRow line;
+	auto&  cols = res->getColumns();
+	for (uint i = 0; i < cols.size(); i++) {
+		auto v = at(i);
+		line.insert(cols[i].name, QByteArray(v.data(), static_cast<int>(v.size())));
+	}
+	return line;
+}
+
+void sqlColumnarResult::append(st_mysql_res* result) {
+	auto         num_fields = mysql_num_fields(result);
+	MYSQL_FIELD* fields     = mysql_fetch_fields(result);
+	if (columns.empty()) {
+		columns.reserve(num_fields);
+		for (uint i = 0; i < num_fields; i++) {
+			columns.push_back({QByteArray(fields[i].name), static_cast<int>(fields[i].type)});
+		}
+	} else if (columns.size() != num_fields) {
+		throw DBException(QSL("columnar result can not merge result set with different column, %1 vs %2").arg(columns.size()).arg(num_fields), DBException::SchemaError);
+	}
+
+	auto row_count = mysql_num_rows(result);
+	auto cells     = (rows + row_count) * num_fields;
+	offsets.reserve(cells + 1);
+	nullMap.resize((cells + 63) / 64, 0);
+
+	for (my_ulonglong j = 0; j < row_count; j++) {
+		MYSQL_ROW row     = mysql_fetch_row(result);
+		auto      lengths = mysql_fetch_lengths(result);
+		for (uint i = 0; i < num_fields; i++) {
+			if (row[i] == nullptr) {
+				auto bit = offsets.size() - 1;
+				nullMap[bit / 64] |= (1ULL << (bit % 64));
+			} else {
+				arena.append(row[i], static_cast<int>(lengths[i]));
+			}
+			if (static_cast<quint64>(arena.size()) > std::numeric_limits<quint32>::max()) {
+				throw DBException(QSL("columnar result set bigger than 4GB, this is not what you want"), DBException::NoResult);
+			}
+			offsets.push_back(static_cast<quint32>(arena.size()));
+		}
+		rows++;
+	}
+}
+
+void sqlColumnarResult::clear() {
+	columns.clear();
+	arena.clear();
+	offsets = {0};
+	nullMap.clear();
+	rows = 0;
+}
+
+uint sqlColumnarResult::rowCount() const {
+	return rows;
+}
+
+quint64 sqlColumnarResult::byteSize() const {
+	return static_cast<quint64>(arena.size());
+}
+
+uint sqlColumnarResult::colCount() const {
+	return static_cast<uint>(columns.size());
+}
+
+bool sqlColumnarResult::isEmpty() const {
+	return rows == 0;
+}
+
+int sqlColumnarResult::columnIndex(const QByteArray& name) const {
+	//usually 5 - 20 column, a linear scan is enough
+	for (uint i = 0; i < columns.size(); i++) {
+		if (columns[i].name == name) {
+			return static_cast<int>(i);
+		}
+	}
+	return -1;
+}
+
+const std::vector<sqlColumn>& sqlColumnarResult::getColumns() const {
+	return columns;
+}
+
+std::string_view sqlColumnarResult::cell(uint row, uint col) const {
+	auto pos = static_cast<size_t>(row) * columns.size() + col;
+	if (nullMap[pos / 64] & (1ULL << (pos % 64))) {
+		if (NULL_as_EMPTY) {
+			return std::string_view();
+		}
+		return std::string_view(BSQL_NULL.constData(), static_cast<size_t>(BSQL_NULL.size()));
+	}
+	auto start = offsets[pos];
+	return std::string_view(arena.constData() + start, offsets[pos + 1] - start);
+}
+
+bool sqlColumnarResult::isNull(uint row, uint col) const {
+	auto pos = static_cast<size_t>(row) * columns.size() + col;
+	return nullMap[pos / 64] & (1ULL << (pos % 64));
+}
+
+sqlColumnarRow sqlColumnarResult::row(uint row) const {
+	return sqlColumnarRow(this, row);
+}
+
+sqlColumnarRow sqlColumnarResult::operator[](uint row) const {
+	return sqlColumnarRow(this, row);
+}
+
+sqlResult sqlColumnarResult::toSqlResult() const {
+	sqlResult res;
+	res.reserve(static_cast<int>(rows));
+	for (uint r = 0; r < rows; r++) {
+		res.push_back(row(r).toSqlRow());
+	}
+	return res;
+}
+
+sqlColumnarResult DB::queryColumnar(const QString& sql) const {
+	return queryColumnar(sql.toUtf8());
+}
+
+sqlColumnarResult DB::queryColumnar(const QByteArray& sql) const {
+	if (sql.isEmpty()) {
+		return sqlColumnarResult();
+	}
+	SQLLogger sqlLogger(sql, conf.logError, this);
+	if (!execQuery(sql, sqlLogger)) {
+		return sqlColumnarResult();
+	}
+	if (noFetch) {
+		return sqlColumnarResult();
+	}
+	return fetchColumnar(&sqlLogger);
+}
+
+sqlColumnarResult DB::fetchColumnar(SQLLogger* sqlLogger) const {
+	QElapsedTimer timer;
+	timer.start();
+
+	sqlColumnarResult res;
+	res.NULL_as_EMPTY = state.get().NULL_as_EMPTY;
+
+	auto    conn = getConn();
+	SqlSpan span("store", mysql_thread_id(conn));
+	do {
+		MYSQL_RES* result = mysql_store_result(conn);
+		if (result != nullptr) {
+			//free even if the append throws
+			auto guard = qScopeGuard([&] { mysql_free_result(result); });
+			res.append(result);
+		}
+	} while (mysql_next_result(conn) == 0);
+	span.end();
+	if (sqlLogger) {
+		sqlLogger->fetchTime = timer.nsecsElapsed();
+		sqlLogger->rows      = res.rowCount();
+		sqlLogger->bytes     = res.byteSize();
+	}
+
+	afterFetch(conn, sqlLogger);
+	return res;
+}
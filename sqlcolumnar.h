@@ -0,0 +1,158 @@
+#pragma once
+
+#include "min_mysql.h"
+#include <string_view>
+#include <vector>
+
+struct sqlColumn {
+	QByteArray name;
+	//enum_field_types, kept as int to avoid dragging mysql.h around
+	int type = 0;
+};
+
+/**
+ * @brief The sqlRowAccess class give to any row type the same accessor of sqlRow (rq / get2 / g16)
+ * Row must provide at(uint), at(const QByteArray&) and contains(const QByteArray&)
+ */
+template <typename Row>
+class sqlRowAccess {
+      public:
+	template <typename D>
+	void rq(const QByteArray& key, D& dest) const {
+		sqlSwap(self().at(key), dest);
+	}
+
+	template <typename D>
+	void rq(uint col, D& dest) const {
+		sqlSwap(self().at(col), dest);
+	}
+
+	QDateTime asDateTime(const QByteArray& key) const {
+		return get2<QDateTime>(key);
+	}
+
+	template <typename D>
+	[[deprecated("use rq")]] void get2(const QByteArray& key, D& dest) const {
+		rq(key, dest);
+	}
+
+	template <typename D>
+	bool get2(const QByteArray& key, D& dest, const D& def) const {
+		if (self().contains(key)) {
+			rq(key, dest);
+			return true;
+		}
+		dest = def;
+		return false;
+	}
+
+	template <typename D>
+	D get2(const QByteArray& key) const {
+		D temp;
+		rq(key, temp);
+		return temp;
+	}
+
+	QString g16(const QByteArray& key) const {
+		return get2<QString>(key);
+	}
+
+	QString g16(const QByteArray& key, const QString def) const {
+		QString val;
+		get2(key, val, def);
+		return val;
+	}
+
+      private:
+	const Row& self() const {
+		return static_cast<const Row&>(*this);
+	}
+};
+
+class sqlColumnarResult;
+
+/**
+ * @brief The sqlColumnarRow class is a cheap handle to a row of a sqlColumnarResult
+ * It offers the same accessor of sqlRow (rq / get2 / g16), so code can be switched with minimal effort
+ * Is only valid as long as the sqlColumnarResult is alive
+ */
+class sqlColumnarRow : public sqlRowAccess<sqlColumnarRow> {
+      public:
+	sqlColumnarRow(const sqlColumnarResult* _res, uint _row);
+
+	std::string_view at(uint col) const;
+	std::string_view at(const QByteArray& key) const;
+	bool             isNull(uint col) const;
+	bool             isNull(const QByteArray& key) const;
+	bool             contains(const QByteArray& key) const;
+
+	//deep copy in the old format
+	sqlRow toSqlRow() const;
+
+      private:
+	const sqlColumnarResult* res = nullptr;
+	uint                     row = 0;
+};
+
+/**
+ * @brief The sqlColumnarResult class store a whole result set in a few flat buffer instead of a map per row
+ * column name and type are stored once, all the cell are packed in a single arena, NULL are tracked in a bitmap
+ * Cell (r,c) is arena[offsets[r * colCount + c], offsets[r * colCount + c + 1])
+ */
+class sqlColumnarResult {
+      public:
+	sqlColumnarResult() = default;
+
+	//Append a whole mysql result set, column must match the one already present (if any)
+	void append(st_mysql_res* result);
+	void clear();
+
+	uint    rowCount() const;
+	uint    colCount() const;
+	bool    isEmpty() const;
+	quint64 byteSize() const; //of all the cell
+	//-1 if not found, resolve once and use the index version in the loop
+	int                           columnIndex(const QByteArray& name) const;
+	const std::vector<sqlColumn>& getColumns() const;
+
+	std::string_view cell(uint row, uint col) const;
+	bool             isNull(uint row, uint col) const;
+
+	sqlColumnarRow row(uint row) const;
+	sqlColumnarRow operator[](uint row) const;
+
+	//deep copy in the old format
+	sqlResult toSqlResult() const;
+
+	//How NULL cells are exposed, same as DB::InternalState::NULL_as_EMPTY
+	bool NULL_as_EMPTY = false;
+
+      private:
+	std::vector<sqlColumn> columns;
+	QByteArray             arena;
+	std::vector<quint32>   offsets{0};
+	std::vector<quint64>   nullMap;
+	uint                   rows = 0;
+};
+
+/**
+ * @brief columnAs convert a whole column at once, Result is either sqlColumnarResult or sqlResultView
+ * resolve the column once, and let the parsing kernel run in a tight loop
+ */
+template <typename T, typename Result>
+std::vector<T> columnAs(const Result& res, uint col) {
+	std::vector<T> dest(res.rowCount());
+	for (uint r = 0; r < dest.size(); r++) {
+		sqlSwap(res.cell(r, col), dest[r]);
+	}
+	return dest;
+}
+
+template <typename T, typename Result>
+std::vector<T> columnAs(const Result& res, const QByteArray& name) {
+	auto col = res.columnIndex(name);
+	if (col < 0) {
+		throw DBException(QSL("missing column %1 in the result set").arg(QString(name)), DBException::SchemaError);
+	}
+	return columnAs<T>(res, static_cast<uint>(col));
+}
@@ -1,11 +1,14 @@
 #include "sqlcomposer.h"
 
 QString SScol::assemble(int padding) const {
-	QString final = key.leftJustified(padding) + QSL("= ");
+	return key.leftJustified(padding) + QSL("= ") + sqlValue();
+}
+
+QString SScol::sqlValue() const {
 	if (aritmetic) {
-		return final + val;
+		return val;
 	} else {
-		return final + mayBeBase64(val);
+		return mayBeBase64(val);
 	}
 }
 
@@ -44,6 +47,10 @@ QString SqlComposer::compose() const {
 	return final;
 }
 
+const std::vector<SScol>& SqlComposer::getColumns() const {
+	return vector;
+}
+
 QString SScol::getKey() const {
 	return key;
 }
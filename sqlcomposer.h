@@ -30,6 +30,8 @@ class SScol {
 	}
 
 	QString getVal() const;
+	//the value as it goes in the SQL (base64 encoded if not a number)
+	QString sqlValue() const;
 
 	QString assemble(int padding = 1) const;
 
@@ -43,6 +45,7 @@ class SqlComposer {
       public:
 	void push(const SScol& col);
 	QString compose() const;
+	const std::vector<SScol>& getColumns() const;
 
 	bool valid = true;
       private:
@@ -0,0 +1,313 @@
+#include "sqlcoroutine.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include "metrics.h"
+#include "mysql/mysql.h"
+#include <QDebug>
+#include <QScopeGuard>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <poll.h>
+
+void coDetail::PromiseBase::logDetachedError(std::exception_ptr error) {
+	try {
+		std::rethrow_exception(error);
+	} catch (const QString& e) {
+		qCritical().noquote() << "exception in a detached task" << e;
+	} catch (const std::exception& e) {
+		qCritical().noquote() << "exception in a detached task" << e.what();
+	} catch (...) {
+		qCritical().noquote() << "unknown exception in a detached task";
+	}
+}
+
+struct AsyncConn::Wait {
+	AsyncConn* self;
+	int        status;
+	int        ready = 0;
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> handle) {
+		uint timeout = 0;
+		if (status & MYSQL_WAIT_TIMEOUT) {
+			timeout = mysql_get_timeout_value_ms(self->conn);
+		}
+		self->scheduler.watch(mysql_get_socket(self->conn), status, timeout, handle, &ready);
+	}
+
+	int await_resume() const noexcept {
+		return ready;
+	}
+};
+
+AsyncConn::AsyncConn(const DBConf& _conf, CoScheduler& _scheduler)
+    : conf(_conf), scheduler(_scheduler) {
+}
+
+AsyncConn::~AsyncConn() {
+	if (conn) {
+		mysql_close(conn);
+	}
+}
+
+AsyncConn::Wait AsyncConn::wait(int status) {
+	return Wait{this, status};
+}
+
+bool AsyncConn::isConnected() const {
+	return conn != nullptr;
+}
+
+Task<> AsyncConn::connect() {
+	if (conn) {
+		mysql_close(conn);
+	}
+	unsigned long flag;
+	conn = mysqlInit(conf, flag);
+
+	st_mysql* connected = nullptr;
+	auto      status    = mysql_real_connect_start(&connected, conn, conf.host, conf.user.constData(), conf.pass.constData(),
+	                                               conf.getDefaultDB(), conf.port, conf.sock.constData(), flag);
+	while (status) {
+		status = mysql_real_connect_cont(&connected, conn, co_await wait(status));
+	}
+	if (!connected) {
+		auto msg = QSL("Mysql connection error (async). for %1 \n Error %2").arg(conf.getInfo()).arg(mysql_error(conn));
+		mysql_close(conn);
+		conn = nullptr;
+		messanger(msg, conf.connErrorVerbosity);
+		throw DBException(msg, DBException::Error::Connection);
+	}
+
+	co_await send(conf.sessionSetup());
+	co_await fetch();
+}
+
+Task<> AsyncConn::send(QByteArray sql) {
+	//the coroutine frame keeps sql alive until the _cont are over
+	lastSQL = sql;
+	DBMetrics::queries().add();
+	DBMetrics::bytesSent().add(sql.size());
+	int  err;
+	auto status = mysql_real_query_start(&err, conn, sql.constData(), static_cast<unsigned long>(sql.size()));
+	while (status) {
+		status = mysql_real_query_cont(&err, conn, co_await wait(status));
+	}
+	if (err) {
+		fail();
+	}
+}
+
+Task<sqlResult> AsyncConn::fetch() {
+	sqlResult res;
+	while (true) {
+		MYSQL_RES* result = nullptr;
+		auto       status = mysql_store_result_start(&result, conn);
+		while (status) {
+			status = mysql_store_result_cont(&result, conn, co_await wait(status));
+		}
+		if (result) {
+			appendRows(result, res, NULL_as_EMPTY);
+			mysql_free_result(result);
+		} else if (mysql_errno(conn)) {
+			fail();
+		}
+
+		if (!mysql_more_results(conn)) {
+			break;
+		}
+		int err;
+		status = mysql_next_result_start(&err, conn);
+		while (status) {
+			status = mysql_next_result_cont(&err, conn, co_await wait(status));
+		}
+		if (err > 0) {
+			fail();
+		}
+	}
+	co_return res;
+}
+
+Task<sqlResult> AsyncConn::query(QByteArray sql) {
+	if (!conn) {
+		co_await connect();
+	}
+	co_await send(sql);
+	co_return co_await fetch();
+}
+
+void AsyncConn::fail() {
+	auto error = mysql_errno(conn);
+	auto err   = QSL("Mysql error for %1 \nerror was %2 code: %3").arg(QString(lastSQL)).arg(mysql_error(conn)).arg(error);
+	qWarning().noquote() << err << QStacker16();
+	//half way in a multi statement or lost, a new connection is the only safe thing
+	mysql_close(conn);
+	conn       = nullptr;
+	cxaNoStack = true;
+	throw err;
+}
+
+CoScheduler::~CoScheduler() {
+	for (auto& [key, list] : idle) {
+		for (auto c : list) {
+			delete c;
+		}
+	}
+}
+
+AsyncConn* CoScheduler::acquire(const DBConf& conf) {
+	auto  key  = conf.poolKey();
+	auto& list = idle[key];
+	if (!list.empty()) {
+		auto c = list.back();
+		list.pop_back();
+		return c;
+	}
+	auto c   = new AsyncConn(conf, *this);
+	owner[c] = key;
+	return c;
+}
+
+void CoScheduler::release(AsyncConn* conn) {
+	auto& list = idle[owner[conn]];
+	if (list.size() < keepIdle) {
+		list.push_back(conn);
+		return;
+	}
+	owner.erase(conn);
+	delete conn;
+}
+
+void PollScheduler::watch(int fd, int status, uint timeoutMs, std::coroutine_handle<> handle, int* ready) {
+	qint64 deadline = 0;
+	if (timeoutMs) {
+		deadline = QDateTime::currentMSecsSinceEpoch() + timeoutMs;
+	}
+	waiting.push_back({fd, status, deadline, handle, ready});
+}
+
+bool PollScheduler::step(int timeoutMs) {
+	if (waiting.empty()) {
+		return false;
+	}
+
+	std::vector<pollfd> pfd(waiting.size());
+	auto                now = QDateTime::currentMSecsSinceEpoch();
+	for (uint i = 0; i < waiting.size(); i++) {
+		auto& w    = waiting[i];
+		pfd[i].fd  = w.fd;
+		pfd[i].events =
+		    (w.status & MYSQL_WAIT_READ ? POLLIN : 0) |
+		    (w.status & MYSQL_WAIT_WRITE ? POLLOUT : 0) |
+		    (w.status & MYSQL_WAIT_EXCEPT ? POLLPRI : 0);
+		if (w.deadline) {
+			auto left = static_cast<int>(std::max<qint64>(0, w.deadline - now));
+			if (timeoutMs < 0 || left < timeoutMs) {
+				timeoutMs = left;
+			}
+		}
+	}
+
+	if (poll(pfd.data(), pfd.size(), timeoutMs) < 0 && errno != EINTR) {
+		throw QSL("PollScheduler: poll failed %1").arg(strerror(errno));
+	}
+
+	//resumed coroutine will add new waiting, so first collect who is ready
+	std::vector<Waiting> resume;
+	std::vector<Waiting> still;
+	now = QDateTime::currentMSecsSinceEpoch();
+	for (uint i = 0; i < waiting.size(); i++) {
+		auto& w       = waiting[i];
+		int   happens = 0;
+		if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+			happens |= MYSQL_WAIT_READ;
+		}
+		if (pfd[i].revents & POLLOUT) {
+			happens |= MYSQL_WAIT_WRITE;
+		}
+		if (pfd[i].revents & POLLPRI) {
+			happens |= MYSQL_WAIT_EXCEPT;
+		}
+		if (!happens && w.deadline && w.deadline <= now) {
+			happens = MYSQL_WAIT_TIMEOUT;
+		}
+		if (happens) {
+			*w.ready = happens;
+			resume.push_back(w);
+		} else {
+			still.push_back(w);
+		}
+	}
+	waiting.swap(still);
+	for (auto& w : resume) {
+		w.handle.resume();
+	}
+	return true;
+}
+
+void PollScheduler::run() {
+	while (step()) {
+	}
+}
+
+PollScheduler& PollScheduler::threadDefault() {
+	thread_local PollScheduler scheduler;
+	return scheduler;
+}
+
+QtScheduler::QtScheduler(QObject* parent)
+    : QObject(parent) {
+}
+
+void QtScheduler::watch(int fd, int status, uint timeoutMs, std::coroutine_handle<> handle, int* ready) {
+	//all the notifier are child of holder, the first one that fires delete everything
+	auto holder = new QObject(this);
+	auto fire   = [holder, handle, ready](int happens) {
+		if (holder->property("fired").toBool()) {
+			return;
+		}
+		holder->setProperty("fired", true);
+		for (auto n : holder->findChildren<QSocketNotifier*>()) {
+			n->setEnabled(false);
+		}
+		holder->deleteLater();
+		*ready = happens;
+		handle.resume();
+	};
+
+	auto notify = [&](QSocketNotifier::Type type, int happens) {
+		auto n = new QSocketNotifier(fd, type, holder);
+		QObject::connect(n, &QSocketNotifier::activated, holder, [fire, happens]() { fire(happens); });
+	};
+	if (status & MYSQL_WAIT_READ) {
+		notify(QSocketNotifier::Read, MYSQL_WAIT_READ);
+	}
+	if (status & MYSQL_WAIT_WRITE) {
+		notify(QSocketNotifier::Write, MYSQL_WAIT_WRITE);
+	}
+	if (status & MYSQL_WAIT_EXCEPT) {
+		notify(QSocketNotifier::Exception, MYSQL_WAIT_EXCEPT);
+	}
+	if (timeoutMs) {
+		QTimer::singleShot(static_cast<int>(timeoutMs), holder, [fire]() { fire(MYSQL_WAIT_TIMEOUT); });
+	}
+}
+
+Task<sqlResult> DB::queryAsync(QByteArray sql, CoScheduler* scheduler) const {
+	auto& sched = scheduler ? *scheduler : PollScheduler::threadDefault();
+	auto  conn  = sched.acquire(getConf());
+	//given back even if the query throws (a connection that failed is already closed, and will reconnect)
+	auto guard = qScopeGuard([&] { sched.release(conn); });
+	conn->NULL_as_EMPTY = state.get().NULL_as_EMPTY;
+	co_return co_await conn->query(std::move(sql));
+}
+
+Task<sqlResult> DB::queryAsync(const QString& sql, CoScheduler* scheduler) const {
+	return queryAsync(sql.toUtf8(), scheduler);
+}
+
+#endif
@@ -0,0 +1,355 @@
+#pragma once
+
+#if defined(__cpp_impl_coroutine)
+
+#include "min_mysql.h"
+#include <QObject>
+#include <coroutine>
+#include <exception>
+#include <map>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+/**
+ * Coroutine interface on top of the mariadb non blocking api (MYSQL_OPT_NONBLOCK)
+ * A query suspends on MYSQL_WAIT_READ / WRITE and is resumed by a CoScheduler when the socket is ready, so
+ * a single thread keeps many query in flight, with sequential looking code:
+
+	Task<> handler(DB& db) {
+		auto [a, b] = co_await whenAll(db.queryAsync(sql1), db.queryAsync(sql2));
+		...
+	}
+	PollScheduler::threadDefault().runUntil(handler(db));
+
+ * Each concurrent query needs its own connection, the scheduler keeps a small set of them per DBConf.
+ * A Task must not be destroyed while suspended.
+ */
+
+class CoScheduler;
+
+namespace coDetail {
+struct PromiseBase {
+	std::exception_ptr      error;
+	std::coroutine_handle<> continuation;
+	bool                    detached = false;
+
+	std::suspend_always initial_suspend() noexcept {
+		return {};
+	}
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept {
+			return false;
+		}
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+			auto& promise = h.promise();
+			if (promise.detached) {
+				if (promise.error) {
+					logDetachedError(promise.error);
+				}
+				h.destroy();
+				return std::noop_coroutine();
+			}
+			if (promise.continuation) {
+				return promise.continuation;
+			}
+			return std::noop_coroutine();
+		}
+		void await_resume() noexcept {
+		}
+	};
+
+	FinalAwaiter final_suspend() noexcept {
+		return {};
+	}
+
+	void unhandled_exception() {
+		error = std::current_exception();
+	}
+
+	void rethrow() {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	static void logDetachedError(std::exception_ptr error);
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+	std::optional<T> value;
+
+	void return_value(T v) {
+		value = std::move(v);
+	}
+
+	T take() {
+		rethrow();
+		return std::move(*value);
+	}
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+	void return_void() {
+	}
+
+	void take() {
+		rethrow();
+	}
+};
+} // namespace coDetail
+
+/**
+ * Lazy task, runs when awaited or start()ed
+ * start() is how more operation are put in flight together, awaiting a started task just waits for the result
+ */
+template <typename T>
+class Task {
+      public:
+	struct promise_type : coDetail::Promise<T> {
+		Task get_return_object() {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+	};
+
+	Task() = default;
+	Task(Task&& other) noexcept
+	    : handle(std::exchange(other.handle, {})), started(other.started) {
+	}
+	Task& operator=(Task&& other) noexcept {
+		if (this != &other) {
+			reset();
+			handle  = std::exchange(other.handle, {});
+			started = other.started;
+		}
+		return *this;
+	}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() {
+		reset();
+	}
+
+	//run until the first suspension
+	void start() {
+		if (!started) {
+			started = true;
+			handle.resume();
+		}
+	}
+
+	//fire and forget, the frame destroy itself at the end (an exception is just logged)
+	void detach() {
+		handle.promise().detached = true;
+		auto h                    = std::exchange(handle, {});
+		if (!started) {
+			h.resume();
+		} else if (h.done()) {
+			h.destroy();
+		}
+	}
+
+	bool done() const {
+		return !handle || handle.done();
+	}
+
+	//only once done
+	T result() {
+		return handle.promise().take();
+	}
+
+	bool await_ready() const noexcept {
+		return done();
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		handle.promise().continuation = awaiting;
+		if (started) {
+			//already running, it will resume us once over
+			return std::noop_coroutine();
+		}
+		started = true;
+		return handle;
+	}
+
+	T await_resume() {
+		return handle.promise().take();
+	}
+
+	//awaiting it waits for the task to be over, without taking the result (or rethrowing the error)
+	struct Settled {
+		Task& task;
+		bool  await_ready() const noexcept {
+			return task.done();
+		}
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+			return task.await_suspend(awaiting);
+		}
+		void await_resume() noexcept {
+		}
+	};
+	Settled settled() {
+		return Settled{*this};
+	}
+
+      private:
+	explicit Task(std::coroutine_handle<promise_type> h)
+	    : handle(h) {
+	}
+
+	void reset() {
+		if (handle) {
+			handle.destroy();
+			handle = {};
+		}
+	}
+
+	std::coroutine_handle<promise_type> handle;
+	bool                                started = false;
+};
+
+namespace coDetail {
+//a Task<void> is a std::monostate in the whenAll tuple
+template <typename T>
+struct WhenAllValue {
+	using type = T;
+};
+template <>
+struct WhenAllValue<void> {
+	using type = std::monostate;
+};
+
+template <typename T>
+typename WhenAllValue<T>::type takeResult(Task<T>& task) {
+	if constexpr (std::is_void_v<T>) {
+		task.result();
+		return {};
+	} else {
+		return task.result();
+	}
+}
+} // namespace coDetail
+
+//start all the task, and wait for all of them, the first error (in argument order) is rethrown once all are over
+template <typename... T>
+Task<std::tuple<typename coDetail::WhenAllValue<T>::type...>> whenAll(Task<T>... tasks) {
+	(tasks.start(), ...);
+	//even if one fails, the other must complete, a suspended task can not be destroyed
+	(co_await tasks.settled(), ...);
+	//braced init list are evaluated left to right
+	co_return std::tuple<typename coDetail::WhenAllValue<T>::type...>{coDetail::takeResult(tasks)...};
+}
+
+//a non blocking connection, used by a single CoScheduler
+class AsyncConn {
+      public:
+	AsyncConn(const DBConf& conf, CoScheduler& scheduler);
+	~AsyncConn();
+	AsyncConn(const AsyncConn&) = delete;
+	AsyncConn& operator=(const AsyncConn&) = delete;
+
+	Task<>          connect();
+	Task<>          send(QByteArray sql);
+	Task<sqlResult> fetch();
+	//connect if needed, send and fetch
+	Task<sqlResult> query(QByteArray sql);
+
+	bool isConnected() const;
+
+	bool NULL_as_EMPTY = false;
+
+      private:
+	//suspend until the socket is ready for what mysql asked, return the status for the _cont
+	struct Wait;
+	Wait wait(int status);
+	void fail();
+
+	DBConf       conf;
+	CoScheduler& scheduler;
+	st_mysql*    conn = nullptr;
+	QByteArray   lastSQL;
+};
+
+class CoScheduler {
+      public:
+	virtual ~CoScheduler();
+	/**
+	 * @brief watch resume handle once fd is ready for status (MYSQL_WAIT_*) or the timeout (ms, 0 none) is over
+	 * @param ready receives the MYSQL_WAIT_* that happened
+	 */
+	virtual void watch(int fd, int status, uint timeoutMs, std::coroutine_handle<> handle, int* ready) = 0;
+
+	//an idle connection for this conf (a new one if none)
+	AsyncConn* acquire(const DBConf& conf);
+	void       release(AsyncConn* conn);
+
+	//idle connection kept per DBConf
+	uint keepIdle = 4;
+
+      private:
+	std::map<QByteArray, std::vector<AsyncConn*>> idle;
+	std::map<AsyncConn*, QByteArray>              owner;
+};
+
+/**
+ * @brief The PollScheduler class is the included scheduler, a plain poll loop
+ */
+class PollScheduler : public CoScheduler {
+      public:
+	void watch(int fd, int status, uint timeoutMs, std::coroutine_handle<> handle, int* ready) override;
+
+	//one poll round (-1 = wait until something happens), false if nothing is waiting
+	bool step(int timeoutMs = -1);
+	//until nothing is waiting anymore
+	void run();
+
+	template <typename T>
+	T runUntil(Task<T>&& task) {
+		return runUntil(task);
+	}
+
+	template <typename T>
+	T runUntil(Task<T>& task) {
+		task.start();
+		while (!task.done()) {
+			if (!step()) {
+				break;
+			}
+		}
+		if (!task.done()) {
+			throw QSL("PollScheduler::runUntil nothing left to wait for, but the task is not over (is it waiting on another scheduler?)");
+		}
+		return task.result();
+	}
+
+	//used by DB::queryAsync if no scheduler is passed
+	static PollScheduler& threadDefault();
+
+      private:
+	struct Waiting {
+		int                     fd;
+		int                     status;
+		qint64                  deadline; //ms since epoch, 0 none
+		std::coroutine_handle<> handle;
+		int*                    ready;
+	};
+	std::vector<Waiting> waiting;
+};
+
+/**
+ * @brief The QtScheduler class resume the coroutine from the Qt event loop of the thread it lives in
+ * (QSocketNotifier + single shot QTimer)
+ */
+class QtScheduler : public CoScheduler, public QObject {
+      public:
+	QtScheduler(QObject* parent = nullptr);
+	void watch(int fd, int status, uint timeoutMs, std::coroutine_handle<> handle, int* ready) override;
+};
+
+#endif
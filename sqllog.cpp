@@ -0,0 +1,335 @@
+#include "sqllog.h"
+#include <QDateTime>
+#include <QDebug>
+#include <cstring>
+
+namespace {
+enum RecordType : quint32 {
+	QueryRecord   = 1,
+	DroppedRecord = 2,
+};
+
+//fixed part of a record, followed by sql, error and res
+struct Wire {
+	quint32 type;
+	quint32 pid;
+	qint64  timestamp;
+	qint64  serverTime;
+	qint64  fetchTime;
+	quint64 mysqlThreadId;
+	quint32 sqlLen;
+	quint32 errorLen;
+	quint32 resLen;
+	quint32 reserved;
+};
+
+QByteArray encode(const Wire& w, const QByteArray& sql = QByteArray(), const QByteArray& error = QByteArray(), const QByteArray& res = QByteArray()) {
+	QByteArray out;
+	out.reserve(static_cast<int>(sizeof(Wire)) + sql.size() + error.size() + res.size());
+	out.append(reinterpret_cast<const char*>(&w), sizeof(w));
+	out.append(sql);
+	out.append(error);
+	out.append(res);
+	return out;
+}
+
+quint64 nextPow2(quint64 v) {
+	quint64 p = 4096;
+	while (p < v) {
+		p <<= 1;
+	}
+	return p;
+}
+
+struct RingHolder {
+	std::shared_ptr<SqlLogRing> ring;
+	~RingHolder() {
+		if (ring) {
+			ring->orphan = true;
+		}
+	}
+};
+thread_local RingHolder ringHolder;
+} // namespace
+
+SqlLogRing::SqlLogRing(uint capacity)
+    : buffer(nextPow2(capacity)), mask(buffer.size() - 1) {
+}
+
+bool SqlLogRing::push(const QByteArray& record) {
+	quint32 len  = static_cast<quint32>(record.size());
+	quint64 need = sizeof(len) + len;
+	auto    h    = head.load(std::memory_order_relaxed);
+	if (need > buffer.size() - (h - tail.load(std::memory_order_acquire))) {
+		return false;
+	}
+	copyIn(h, reinterpret_cast<const char*>(&len), sizeof(len));
+	copyIn(h + sizeof(len), record.constData(), len);
+	head.store(h + need, std::memory_order_release);
+	return true;
+}
+
+void SqlLogRing::drainTo(QByteArray& out) {
+	auto t = tail.load(std::memory_order_relaxed);
+	auto h = head.load(std::memory_order_acquire);
+	if (t == h) {
+		return;
+	}
+	//the framing is kept, so the file is just the concatenation of the ring content
+	auto size = h - t;
+	auto old  = out.size();
+	out.resize(old + static_cast<int>(size));
+	copyOut(t, out.data() + old, size);
+	tail.store(h, std::memory_order_release);
+}
+
+bool SqlLogRing::isEmpty() const {
+	return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+}
+
+void SqlLogRing::copyIn(quint64 pos, const char* src, quint64 len) {
+	auto start = pos & mask;
+	auto first = std::min<quint64>(len, buffer.size() - start);
+	memcpy(buffer.data() + start, src, first);
+	memcpy(buffer.data(), src + first, len - first);
+}
+
+void SqlLogRing::copyOut(quint64 pos, char* dst, quint64 len) const {
+	auto start = pos & mask;
+	auto first = std::min<quint64>(len, buffer.size() - start);
+	memcpy(dst, buffer.data() + start, first);
+	memcpy(dst + first, buffer.data(), len - first);
+}
+
+SqlLogWriter& SqlLogWriter::instance() {
+	static SqlLogWriter writer;
+	return writer;
+}
+
+SqlLogWriter::SqlLogWriter() {
+	thread = std::thread(&SqlLogWriter::run, this);
+}
+
+SqlLogWriter::~SqlLogWriter() {
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		stop = true;
+	}
+	cv.notify_all();
+	thread.join();
+}
+
+SqlLogRing* SqlLogWriter::ring() {
+	if (!ringHolder.ring) {
+		ringHolder.ring = std::make_shared<SqlLogRing>(ringSize);
+		std::lock_guard<std::mutex> guard(ringsMutex);
+		rings.push_back(ringHolder.ring);
+	}
+	return ringHolder.ring.get();
+}
+
+//keep the head of the text, and say how big it was
+static QByteArray cut(const QByteArray& text, quint64 max) {
+	if (static_cast<quint64>(text.size()) <= max) {
+		return text;
+	}
+	auto note = QByteArray("\n... [truncated, ") + QByteArray::number(text.size()) + " byte]";
+	return text.left(static_cast<int>(max > static_cast<quint64>(note.size()) ? max - note.size() : 0)) + note;
+}
+
+bool SqlLogWriter::log(const Record& record) {
+	auto r = ring();
+	//so a few of them still fit in the ring
+	quint64 max  = r->capacity() / 4 - sizeof(Wire) - sizeof(quint32);
+	quint64 size = static_cast<quint64>(record.sql.size()) + record.error.size() + record.res.size();
+	if (size > max) {
+		//the error is short and the most useful part, the result dump goes first, then the sql
+		auto error = cut(record.error, max / 4);
+		auto sql   = cut(record.sql, (max - error.size()) / 2);
+		auto res   = cut(record.res, max - error.size() - sql.size());
+		return push(r, record, sql, error, res);
+	}
+	return push(r, record, record.sql, record.error, record.res);
+}
+
+bool SqlLogWriter::push(SqlLogRing* r, const Record& record, const QByteArray& sql, const QByteArray& error, const QByteArray& res) {
+	Wire w;
+	w.type          = QueryRecord;
+	w.pid           = record.pid;
+	w.timestamp     = record.timestamp;
+	w.serverTime    = record.serverTime;
+	w.fetchTime     = record.fetchTime;
+	w.mysqlThreadId = record.mysqlThreadId;
+	w.sqlLen        = static_cast<quint32>(sql.size());
+	w.errorLen      = static_cast<quint32>(error.size());
+	w.resLen        = static_cast<quint32>(res.size());
+	w.reserved      = 0;
+	if (!r->push(encode(w, sql, error, res))) {
+		dropped++;
+		return false;
+	}
+	return true;
+}
+
+void SqlLogWriter::sync() {
+	std::unique_lock<std::mutex> lock(mutex);
+	auto                         target = ++syncAsked;
+	cv.notify_all();
+	cv.wait(lock, [&] { return synced >= target || stop; });
+}
+
+quint64 SqlLogWriter::getDropped() {
+	return dropped;
+}
+
+quint64 SqlLogWriter::getWritten() {
+	return written;
+}
+
+void SqlLogWriter::run() {
+	QByteArray batch;
+	while (true) {
+		quint64 asked;
+		bool    last;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait_for(lock, std::chrono::milliseconds(20), [&] { return stop || syncAsked > synced; });
+			asked = syncAsked;
+			last  = stop;
+		}
+
+		batch.clear();
+		if (drain(batch)) {
+			write(batch);
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			synced = asked;
+		}
+		cv.notify_all();
+		if (last) {
+			return;
+		}
+	}
+}
+
+bool SqlLogWriter::drain(QByteArray& out) {
+	std::lock_guard<std::mutex> guard(ringsMutex);
+	for (auto iter = rings.begin(); iter != rings.end();) {
+		auto& r = *iter;
+		//read the flag before draining, so nothing pushed before the thread exit is lost
+		bool orphan = r->orphan;
+		r->drainTo(out);
+		if (orphan) {
+			iter = rings.erase(iter);
+		} else {
+			++iter;
+		}
+	}
+
+	if (auto d = dropped.load(); d != reportedDropped) {
+		Wire w{};
+		w.type       = DroppedRecord;
+		w.timestamp  = QDateTime::currentMSecsSinceEpoch();
+		w.serverTime = static_cast<qint64>(d - reportedDropped);
+		auto    rec  = encode(w);
+		quint32 len  = static_cast<quint32>(rec.size());
+		out.append(reinterpret_cast<const char*>(&len), sizeof(len));
+		out.append(rec);
+		reportedDropped = d;
+	}
+	return !out.isEmpty();
+}
+
+void SqlLogWriter::open() {
+	file.setFileName(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+		qWarning().noquote() << "impossible to open" << fileName << file.errorString();
+		return;
+	}
+	fileSize = static_cast<quint64>(file.size());
+}
+
+void SqlLogWriter::rotate() {
+	file.close();
+	QFile::remove(fileName + "." + QString::number(keepFiles));
+	for (uint i = keepFiles; i > 1; i--) {
+		QFile::rename(fileName + "." + QString::number(i - 1), fileName + "." + QString::number(i));
+	}
+	QFile::rename(fileName, fileName + ".1");
+	open();
+}
+
+void SqlLogWriter::write(const QByteArray& data) {
+	if (!file.isOpen()) {
+		open();
+	} else if (maxFileSize && fileSize + static_cast<quint64>(data.size()) > maxFileSize) {
+		rotate();
+	}
+	if (!file.isOpen()) {
+		return;
+	}
+	file.write(data);
+	file.flush();
+	fileSize += static_cast<quint64>(data.size());
+	written += static_cast<quint64>(data.size());
+}
+
+qint64 SqlLogWriter::decode(const QString& binPath, const QString& textPath) {
+	QFile in(binPath);
+	if (!in.open(QIODevice::ReadOnly)) {
+		qWarning().noquote() << "impossible to open" << binPath << in.errorString();
+		return -1;
+	}
+	QFile out(textPath);
+	if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qWarning().noquote() << "impossible to open" << textPath << out.errorString();
+		return -1;
+	}
+
+	auto   data  = in.readAll();
+	int    pos   = 0;
+	qint64 count = 0;
+	while (pos + static_cast<int>(sizeof(quint32)) <= data.size()) {
+		quint32 len;
+		memcpy(&len, data.constData() + pos, sizeof(len));
+		pos += sizeof(len);
+		if (len < sizeof(Wire) || pos + static_cast<qint64>(len) > data.size()) {
+			qWarning().noquote() << "truncated record in" << binPath << "at" << pos;
+			break;
+		}
+		Wire w;
+		memcpy(&w, data.constData() + pos, sizeof(w));
+		auto body = data.constData() + pos + sizeof(w);
+		pos += static_cast<int>(len);
+		if (sizeof(Wire) + w.sqlLen + w.errorLen + w.resLen != len) {
+			qWarning().noquote() << "corrupted record in" << binPath << "at" << pos;
+			break;
+		}
+
+		auto time = QDateTime::fromMSecsSinceEpoch(w.timestamp).toString(Qt::ISODateWithMs);
+		if (w.type == DroppedRecord) {
+			out.write(time.toUtf8() + "\n" + QByteArray::number(w.serverTime) + " record dropped, the log ring was full\n-------------\n");
+			continue;
+		}
+		out.write(time.toUtf8() + "\n");
+		out.write(QSL("PID: %1, MySQL Thread: %2 \n").arg(w.pid).arg(w.mysqlThreadId).toUtf8());
+
+		QByteArray sql(body, static_cast<int>(w.sqlLen));
+		QByteArray error(body + w.sqlLen, static_cast<int>(w.errorLen));
+		QByteArray res(body + w.sqlLen + w.errorLen, static_cast<int>(w.resLen));
+
+		QByteArray buff = "Query: " + QByteArray::number(w.serverTime / 1E9, 'E', 3);
+		out.write(buff.leftJustified(20, ' ').append("Fetch: " + QByteArray::number(w.fetchTime / 1E9, 'E', 3)) + "\n" + sql);
+		if (!error.isEmpty()) {
+			out.write(QBL("\nError: ") + error);
+			if (!res.isEmpty()) {
+				out.write("\n" + res);
+			}
+		}
+		out.write("\n-------------\n");
+		count++;
+	}
+	return count;
+}
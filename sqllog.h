@@ -0,0 +1,119 @@
+#pragma once
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef QBL
+#define QBL(str) QByteArrayLiteral(str)
+#define QSL(str) QStringLiteral(str)
+#endif
+
+/**
+ * @brief The SqlLogRing class is a single producer single consumer ring of variable size records
+ * the owning thread push, the writer thread pop, no lock on either side. If there is no space the record is dropped
+ */
+class SqlLogRing {
+      public:
+	SqlLogRing(uint capacity);
+
+	//owner thread only, false if the record did not fit
+	bool    push(const QByteArray& record);
+	//writer thread only, append all the complete record (with their length prefix) to out
+	void    drainTo(QByteArray& out);
+	bool    isEmpty() const;
+	quint64 capacity() const {
+		return buffer.size();
+	}
+
+	//set when the owner thread exits, the writer drops the ring once empty
+	std::atomic<bool> orphan{false};
+
+      private:
+	void copyIn(quint64 pos, const char* src, quint64 len);
+	void copyOut(quint64 pos, char* dst, quint64 len) const;
+
+	std::vector<char> buffer;
+	const quint64     mask;
+	//on different cache line, each is written by a single thread
+	alignas(64) std::atomic<quint64> head{0};
+	alignas(64) std::atomic<quint64> tail{0};
+};
+
+/**
+ * @brief The SqlLogWriter class collects the SQLLogger record from the per thread rings and appends them to a binary file,
+ * rotated by size (sql.log.bin, sql.log.bin.1 ...). The query path only encodes a record and pushes it, never waits for the disk.
+ * Use decode to get back the old sql.log text format
+ */
+class SqlLogWriter {
+      public:
+	//only read before the first record is logged
+	inline static QString fileName    = "sql.log.bin";
+	inline static quint64 maxFileSize = 256 * 1024 * 1024;
+	inline static uint    keepFiles   = 4;
+	inline static uint    ringSize    = 1024 * 1024;
+
+	static SqlLogWriter& instance();
+	~SqlLogWriter();
+
+	struct Record {
+		qint64     timestamp     = 0; //ms since epoch
+		qint64     serverTime    = 0; //ns
+		qint64     fetchTime     = 0; //ns
+		quint32    pid           = 0;
+		quint64    mysqlThreadId = 0;
+		QByteArray sql;
+		QByteArray error;
+		//the result set dump, only in case of error
+		QByteArray res;
+	};
+
+	//never blocks, false (and counted in getDropped) if the ring of this thread is full
+	//a record too big for the ring (a bulk statement...) is logged with the sql / res cut
+	bool log(const Record& record);
+	//block until all the record logged so far are on disk
+	void sync();
+
+	static quint64 getDropped();
+	static quint64 getWritten();
+
+	/**
+	 * @brief decode a binary log file in the human readable sql.log format
+	 * @return the number of record decoded, -1 if the input could not be read
+	 */
+	static qint64 decode(const QString& binPath, const QString& textPath);
+
+      private:
+	SqlLogWriter();
+	SqlLogRing* ring();
+	bool        push(SqlLogRing* r, const Record& record, const QByteArray& sql, const QByteArray& error, const QByteArray& res);
+	void        run();
+	bool        drain(QByteArray& out);
+	void        write(const QByteArray& data);
+	void        rotate();
+	void        open();
+
+	std::mutex                               ringsMutex;
+	std::vector<std::shared_ptr<SqlLogRing>> rings;
+
+	std::mutex              mutex;
+	std::condition_variable cv;
+	bool                    stop      = false;
+	quint64                 synced    = 0;
+	quint64                 syncAsked = 0;
+	std::thread             thread;
+
+	QFile   file;
+	quint64 fileSize = 0;
+	//already noted in the file
+	quint64 reportedDropped = 0;
+
+	inline static std::atomic<quint64> dropped{0};
+	inline static std::atomic<quint64> written{0};
+};
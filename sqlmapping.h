@@ -0,0 +1,109 @@
+#pragma once
+
+#include "sqlresultview.h"
+#include <array>
+#include <tuple>
+#include <utility>
+
+/**
+  Map each row directly into a struct (or a tuple), the column are resolved once per result set,
+  and each cell is converted straight from the mysql buffer, no sqlRow in the middle
+
+	struct User {
+		quint64 id;
+		QString name;
+		static constexpr auto sqlFields = std::make_tuple(
+		    sqlBind("id", &User::id),
+		    sqlBind("name", &User::name));
+	};
+
+	std::vector<User> users = db.queryAs<User>("SELECT id, name FROM user");
+	auto pairs = db.queryTuple<quint64, QString>("SELECT id, name FROM user");
+
+  A type that sqlSwap can not convert will fail at compile time
+ */
+template <typename Struct, typename Field>
+struct sqlField {
+	const char* name;
+	Field Struct::*member;
+};
+
+template <typename Struct, typename Field>
+constexpr sqlField<Struct, Field> sqlBind(const char* name, Field Struct::*member) {
+	return {name, member};
+}
+
+namespace sqlMapping {
+
+inline uint column(const sqlResultView& res, const char* name, const QByteArray& sql) {
+	auto idx = res.columnIndex(name);
+	if (idx < 0) {
+		throw DBException(QSL("missing column %1 in the result set for %2").arg(name).arg(QString(sql)), DBException::SchemaError);
+	}
+	return static_cast<uint>(idx);
+}
+
+template <typename T, size_t... I>
+std::array<uint, sizeof...(I)> bind(const sqlResultView& res, const QByteArray& sql, std::index_sequence<I...>) {
+	return {column(res, std::get<I>(T::sqlFields).name, sql)...};
+}
+
+template <typename T, size_t... I>
+void fill(const sqlResultView& res, uint row, const std::array<uint, sizeof...(I)>& cols, T& dest, std::index_sequence<I...>) {
+	(sqlSwap(res.cell(row, cols[I]), dest.*(std::get<I>(T::sqlFields).member)), ...);
+}
+
+template <typename Tuple, size_t... I>
+void fillTuple(const sqlResultView& res, uint row, Tuple& dest, std::index_sequence<I...>) {
+	(sqlSwap(res.cell(row, I), std::get<I>(dest)), ...);
+}
+
+} // namespace sqlMapping
+
+template <typename T>
+std::vector<T> DB::queryAs(const QString& sql) const {
+	return queryAs<T>(sql.toUtf8());
+}
+
+template <typename T>
+std::vector<T> DB::queryAs(const QByteArray& sql) const {
+	constexpr auto fieldCount = std::tuple_size_v<std::decay_t<decltype(T::sqlFields)>>;
+
+	auto res = queryView(sql);
+	if (res.isEmpty()) {
+		return {};
+	}
+
+	//resolve the binding once
+	auto cols = sqlMapping::bind<T>(res, sql, std::make_index_sequence<fieldCount>{});
+
+	std::vector<T> out;
+	out.resize(res.rowCount());
+	for (uint r = 0; r < res.rowCount(); r++) {
+		sqlMapping::fill(res, r, cols, out[r], std::make_index_sequence<fieldCount>{});
+	}
+	return out;
+}
+
+template <typename... T>
+std::vector<std::tuple<T...>> DB::queryTuple(const QString& sql) const {
+	return queryTuple<T...>(sql.toUtf8());
+}
+
+template <typename... T>
+std::vector<std::tuple<T...>> DB::queryTuple(const QByteArray& sql) const {
+	auto res = queryView(sql);
+	if (res.isEmpty()) {
+		return {};
+	}
+	if (res.colCount() < sizeof...(T)) {
+		throw DBException(QSL("result set has %1 column, but %2 are requested for %3").arg(res.colCount()).arg(sizeof...(T)).arg(QString(sql)), DBException::SchemaError);
+	}
+
+	std::vector<std::tuple<T...>> out;
+	out.resize(res.rowCount());
+	for (uint r = 0; r < res.rowCount(); r++) {
+		sqlMapping::fillTuple(res, r, out[r], std::index_sequence_for<T...>{});
+	}
+	return out;
+}
@@ -0,0 +1,78 @@
+#include "sqlparse.h"
+
+namespace {
+
+//fixed width, only digit allowed
+inline bool digits(const char* p, int len, int& dest) {
+	int v = 0;
+	for (int i = 0; i < len; i++) {
+		unsigned d = static_cast<unsigned char>(p[i]) - '0';
+		if (d > 9) {
+			return false;
+		}
+		v = v * 10 + static_cast<int>(d);
+	}
+	dest = v;
+	return true;
+}
+
+inline bool parseDate(const char* p, QDate& dest) {
+	int y, m, d;
+	if (p[4] != '-' || p[7] != '-') {
+		return false;
+	}
+	if (!digits(p, 4, y) || !digits(p + 5, 2, m) || !digits(p + 8, 2, d)) {
+		return false;
+	}
+	//0000-00-00 and friends will just be invalid, as before
+	dest = QDate(y, m, d);
+	return true;
+}
+
+} // namespace
+
+QDate sqlParse::date(std::string_view source) {
+	QDate date;
+	if (source.size() != 10) {
+		return date;
+	}
+	parseDate(source.data(), date);
+	return date;
+}
+
+QDateTime sqlParse::dateTime(std::string_view source) {
+	//yyyy-MM-dd HH:mm:ss is 19, fraction can add from 2 to 7 char
+	auto size = source.size();
+	if (size != 19 && (size < 21 || size > 26)) {
+		return QDateTime();
+	}
+	auto  p = source.data();
+	QDate date;
+	if (!parseDate(p, date) || p[10] != ' ' || p[13] != ':' || p[16] != ':') {
+		return QDateTime();
+	}
+	int h, m, s;
+	if (!digits(p + 11, 2, h) || !digits(p + 14, 2, m) || !digits(p + 17, 2, s)) {
+		return QDateTime();
+	}
+	int ms = 0;
+	if (size > 19) {
+		if (p[19] != '.') {
+			return QDateTime();
+		}
+		//QTime has only ms precision, the rest is just validated
+		int fraction;
+		int len = static_cast<int>(size) - 20;
+		if (!digits(p + 20, len, fraction)) {
+			return QDateTime();
+		}
+		for (; len < 3; len++) {
+			fraction *= 10;
+		}
+		for (; len > 3; len--) {
+			fraction /= 10;
+		}
+		ms = fraction;
+	}
+	return QDateTime(date, QTime(h, m, s, ms), Qt::UTC);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <QDateTime>
+#include <charconv>
+#include <string_view>
+#include <type_traits>
+
+/**
+ * Parsing kernel for the text protocol cell, used by sqlSwap
+ * No locale, no allocation, no QString in the middle
+ */
+namespace sqlParse {
+
+/**
+ * @brief number parse the whole string, false if is not a valid number (or if something is left)
+ * Integer are parsed as 64bit and then assigned, exactly as the old toLongLong path
+ */
+template <typename T>
+bool number(std::string_view source, T& dest) {
+	static_assert(std::is_arithmetic_v<T>);
+	auto begin = source.data();
+	auto end   = source.data() + source.size();
+	if constexpr (std::is_floating_point_v<T>) {
+		double v;
+		auto [ptr, ec] = std::from_chars(begin, end, v);
+		if (ec != std::errc() || ptr != end) {
+			return false;
+		}
+		dest = static_cast<T>(v);
+	} else if constexpr (std::is_signed_v<T>) {
+		long long v;
+		auto [ptr, ec] = std::from_chars(begin, end, v);
+		if (ec != std::errc() || ptr != end) {
+			return false;
+		}
+		dest = static_cast<T>(v);
+	} else {
+		unsigned long long v;
+		auto [ptr, ec] = std::from_chars(begin, end, v);
+		if (ec != std::errc() || ptr != end) {
+			return false;
+		}
+		dest = static_cast<T>(v);
+	}
+	return true;
+}
+
+//yyyy-MM-dd, invalid QDate if the layout does not match
+QDate date(std::string_view source);
+//yyyy-MM-dd HH:mm:ss[.ffffff], in UTC (the connection is forced in UTC), invalid QDateTime if the layout does not match
+QDateTime dateTime(std::string_view source);
+
+} // namespace sqlParse
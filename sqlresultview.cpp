@@ -0,0 +1,187 @@
+#include "sqlresultview.h"
+#include "sqltrace.h"
+#include "mysql/mysql.h"
+#include <QElapsedTimer>
+
+sqlRowView::sqlRowView(const sqlResultView* _res, uint _row)
+    : res(_res), row(_row) {
+}
+
+std::string_view sqlRowView::at(uint col) const {
+	return res->cell(row, col);
+}
+
+std::string_view sqlRowView::at(const QByteArray& key) const {
+	auto col = res->columnIndex(key);
+	if (col < 0) {
+		throw DBException(QSL("missing column %1 in the result set").arg(QString(key)), DBException::SchemaError);
+	}
+	return res->cell(row, static_cast<uint>(col));
+}
+
+bool sqlRowView::isNull(uint col) const {
+	return res->isNull(row, col);
+}
+
+bool sqlRowView::isNull(const QByteArray& key) const {
+	auto col = res->columnIndex(key);
+	if (col < 0) {
+		throw DBException(QSL("missing column %1 in the result set").arg(QString(key)), DBException::SchemaError);
+	}
+	return res->isNull(row, static_cast<uint>(col));
+}
+
+bool sqlRowView::contains(const QByteArray& key) const {
+	return res->columnIndex(key) >= 0;
+}
+
+sqlRow sqlRowView::materialize() const {
+	sqlRow line;
+	auto&  cols = res->getColumns();
+	for (uint i = 0; i < cols.size(); i++) {
+		auto v = at(i);
+		line.insert(cols[i].name, QByteArray(v.data(), static_cast<int>(v.size())));
+	}
+	return line;
+}
+
+void sqlResultView::ResultFree::operator()(st_mysql_res* result) const {
+	mysql_free_result(result);
+}
+
+sqlResultView::sqlResultView(st_mysql_res* _result, bool _NULL_as_EMPTY)
+    : NULL_as_EMPTY(_NULL_as_EMPTY), result(_result) {
+	if (!result) {
+		return;
+	}
+	auto         num_fields = mysql_num_fields(_result);
+	MYSQL_FIELD* fields     = mysql_fetch_fields(_result);
+	columns.reserve(num_fields);
+	for (uint i = 0; i < num_fields; i++) {
+		columns.push_back({QByteArray(fields[i].name), static_cast<int>(fields[i].type)});
+	}
+
+	auto row_count = mysql_num_rows(_result);
+	rows.reserve(row_count);
+	lengths.reserve(row_count * num_fields);
+	while (MYSQL_ROW row = mysql_fetch_row(_result)) {
+		rows.push_back(row);
+		auto len = mysql_fetch_lengths(_result);
+		lengths.insert(lengths.end(), len, len + num_fields);
+	}
+}
+
+uint sqlResultView::rowCount() const {
+	return static_cast<uint>(rows.size());
+}
+
+quint64 sqlResultView::byteSize() const {
+	quint64 size = 0;
+	for (auto l : lengths) {
+		size += l;
+	}
+	return size;
+}
+
+uint sqlResultView::colCount() const {
+	return static_cast<uint>(columns.size());
+}
+
+bool sqlResultView::isEmpty() const {
+	return rows.empty();
+}
+
+int sqlResultView::columnIndex(const QByteArray& name) const {
+	for (uint i = 0; i < columns.size(); i++) {
+		if (columns[i].name == name) {
+			return static_cast<int>(i);
+		}
+	}
+	return -1;
+}
+
+const std::vector<sqlColumn>& sqlResultView::getColumns() const {
+	return columns;
+}
+
+std::string_view sqlResultView::cell(uint row, uint col) const {
+	auto value = rows[row][col];
+	if (value == nullptr) {
+		if (NULL_as_EMPTY) {
+			return std::string_view();
+		}
+		return std::string_view(BSQL_NULL.constData(), static_cast<size_t>(BSQL_NULL.size()));
+	}
+	return std::string_view(value, lengths[static_cast<size_t>(row) * columns.size() + col]);
+}
+
+bool sqlResultView::isNull(uint row, uint col) const {
+	return rows[row][col] == nullptr;
+}
+
+sqlRowView sqlResultView::row(uint row) const {
+	return sqlRowView(this, row);
+}
+
+sqlRowView sqlResultView::operator[](uint row) const {
+	return sqlRowView(this, row);
+}
+
+sqlResult sqlResultView::materialize() const {
+	sqlResult res;
+	res.reserve(static_cast<int>(rows.size()));
+	for (uint r = 0; r < rows.size(); r++) {
+		res.push_back(row(r).materialize());
+	}
+	return res;
+}
+
+sqlResultView DB::queryView(const QString& sql) const {
+	return queryView(sql.toUtf8());
+}
+
+sqlResultView DB::queryView(const QByteArray& sql) const {
+	if (sql.isEmpty()) {
+		return sqlResultView();
+	}
+	SQLLogger sqlLogger(sql, conf.logError, this);
+	if (!execQuery(sql, sqlLogger)) {
+		return sqlResultView();
+	}
+	if (noFetch) {
+		return sqlResultView();
+	}
+	return fetchView(&sqlLogger);
+}
+
+sqlResultView DB::fetchView(SQLLogger* sqlLogger) const {
+	QElapsedTimer timer;
+	timer.start();
+
+	sqlResultView res;
+	auto          conn = getConn();
+	SqlSpan       span("store", mysql_thread_id(conn));
+	//A view can only point to a single result set, we keep the first one (even if empty), the other are just drained
+	bool taken = false;
+	do {
+		MYSQL_RES* result = mysql_store_result(conn);
+		if (result == nullptr) {
+			continue;
+		}
+		if (!taken) {
+			res   = sqlResultView(result, state.get().NULL_as_EMPTY);
+			taken = true;
+		} else {
+			mysql_free_result(result);
+		}
+	} while (mysql_next_result(conn) == 0);
+	span.end();
+	if (sqlLogger) {
+		sqlLogger->fetchTime = timer.nsecsElapsed();
+		sqlLogger->rows      = res.rowCount();
+		sqlLogger->bytes     = res.byteSize();
+	}
+
+	afterFetch(conn, sqlLogger);
+	return res;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "sqlcolumnar.h"
+#include <memory>
+
+class sqlResultView;
+
+/**
+ * @brief The sqlRowView class is a row of a sqlResultView, each cell is a slice of the buffer returned by mysql_store_result
+ * Nothing is copied until you ask for it (rq / get2 / g16 / materialize)
+ */
+class sqlRowView : public sqlRowAccess<sqlRowView> {
+      public:
+	sqlRowView(const sqlResultView* _res, uint _row);
+
+	std::string_view at(uint col) const;
+	std::string_view at(const QByteArray& key) const;
+	bool             isNull(uint col) const;
+	bool             isNull(const QByteArray& key) const;
+	bool             contains(const QByteArray& key) const;
+
+	//deep copy in the old format
+	sqlRow materialize() const;
+
+      private:
+	const sqlResultView* res = nullptr;
+	uint                 row = 0;
+};
+
+/**
+ * @brief The sqlResultView class owns a MYSQL_RES, and gives access to it without copying the cells
+ * All the sqlRowView (and the string_view they return) are valid as long as this object is alive
+ */
+class sqlResultView {
+      public:
+	sqlResultView() = default;
+	sqlResultView(st_mysql_res* result, bool _NULL_as_EMPTY = false);
+
+	//Non copyable, movable
+	sqlResultView(const sqlResultView&) = delete;
+	sqlResultView& operator=(const sqlResultView&) = delete;
+	sqlResultView(sqlResultView&&)                 = default;
+	sqlResultView& operator=(sqlResultView&&) = default;
+
+	uint    rowCount() const;
+	uint    colCount() const;
+	bool    isEmpty() const;
+	quint64 byteSize() const; //of all the cell
+	//-1 if not found, resolve once and use the index version in the loop
+	int                           columnIndex(const QByteArray& name) const;
+	const std::vector<sqlColumn>& getColumns() const;
+
+	std::string_view cell(uint row, uint col) const;
+	bool             isNull(uint row, uint col) const;
+
+	sqlRowView row(uint row) const;
+	sqlRowView operator[](uint row) const;
+
+	//deep copy in the old format
+	sqlResult materialize() const;
+
+	bool NULL_as_EMPTY = false;
+
+      private:
+	struct ResultFree {
+		void operator()(st_mysql_res* result) const;
+	};
+	std::unique_ptr<st_mysql_res, ResultFree> result;
+	std::vector<sqlColumn>                    columns;
+	//MYSQL_ROW of each line
+	std::vector<char**> rows;
+	//rows * colCount, mysql_fetch_lengths is only valid for the current row
+	std::vector<unsigned long> lengths;
+};
@@ -0,0 +1,112 @@
+#include "sqltrace.h"
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+struct ThreadBuffer {
+	std::mutex                  mutex;
+	std::vector<SqlTrace::Span> spans;
+	size_t                      next = 0; //once full, the oldest is overwritten
+	qint64                      tid  = 0;
+};
+
+struct Registry {
+	std::mutex                                 mutex;
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+};
+
+Registry& registry() {
+	static Registry r;
+	return r;
+}
+
+ThreadBuffer& localBuffer() {
+	//kept alive by the registry after the thread exit, so the span are still exported (see exportChrome)
+	thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+		auto b = std::make_shared<ThreadBuffer>();
+		b->tid = syscall(SYS_gettid);
+		std::lock_guard<std::mutex> guard(registry().mutex);
+		registry().buffers.push_back(b);
+		return b;
+	}();
+	return *buffer;
+}
+} // namespace
+
+void SqlTrace::enable(bool on) {
+	enabled.store(on, std::memory_order_relaxed);
+}
+
+void SqlTrace::record(Span&& span) {
+	auto&                       b = localBuffer();
+	std::lock_guard<std::mutex> guard(b.mutex);
+	if (b.spans.size() < maxSpansPerThread) {
+		b.spans.push_back(std::move(span));
+		return;
+	}
+	if (b.spans.empty()) {
+		return;
+	}
+	b.spans[b.next] = std::move(span);
+	b.next          = (b.next + 1) % b.spans.size();
+}
+
+QByteArray SqlTrace::exportChrome() {
+	static const qint64 pid = getpid();
+
+	QJsonArray                  events;
+	std::lock_guard<std::mutex> guard(registry().mutex);
+	for (auto& b : registry().buffers) {
+		std::lock_guard<std::mutex> bufferGuard(b->mutex);
+		for (auto& span : b->spans) {
+			QJsonObject args;
+			if (span.conn) {
+				args.insert(QStringLiteral("conn"), static_cast<qint64>(span.conn));
+			}
+			if (!span.detail.isEmpty()) {
+				args.insert(QStringLiteral("detail"), QString::fromUtf8(span.detail));
+			}
+			QJsonObject ev;
+			ev.insert(QStringLiteral("name"), QString::fromLatin1(span.name));
+			ev.insert(QStringLiteral("cat"), QStringLiteral("sql"));
+			ev.insert(QStringLiteral("ph"), QStringLiteral("X"));
+			//trace_event wants microseconds
+			ev.insert(QStringLiteral("ts"), span.start / 1000.0);
+			ev.insert(QStringLiteral("dur"), span.dur / 1000.0);
+			ev.insert(QStringLiteral("pid"), pid);
+			ev.insert(QStringLiteral("tid"), b->tid);
+			ev.insert(QStringLiteral("args"), args);
+			events.append(ev);
+		}
+	}
+	//only the registry holds them, the thread is gone and its span are now exported
+	auto& buffers = registry().buffers;
+	buffers.erase(std::remove_if(buffers.begin(), buffers.end(), [](auto& b) { return b.use_count() == 1; }), buffers.end());
+	QJsonObject root;
+	root.insert(QStringLiteral("traceEvents"), events);
+	root.insert(QStringLiteral("displayTimeUnit"), QStringLiteral("ns"));
+	return QJsonDocument(root).toJson(QJsonDocument::Compact);
+}
+
+void SqlTrace::clear() {
+	auto&                       r = registry();
+	std::lock_guard<std::mutex> guard(r.mutex);
+	for (auto iter = r.buffers.begin(); iter != r.buffers.end();) {
+		//only the registry holds it, the thread is gone
+		if (iter->use_count() == 1) {
+			iter = r.buffers.erase(iter);
+			continue;
+		}
+		std::lock_guard<std::mutex> bufferGuard((*iter)->mutex);
+		(*iter)->spans.clear();
+		(*iter)->next = 0;
+		++iter;
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <QByteArray>
+#include <atomic>
+#include <chrono>
+
+/**
+ * @brief The SqlTrace class collects the timing of each phase of a query (connect, ping, send, wait, store, convert, warning, flush)
+ * Off by default, when off a SqlSpan costs a relaxed atomic load.
+ * Each thread write in its own buffer (the last maxSpansPerThread span are kept), exportChrome merges them
+ * in the Chrome trace_event format (load it in chrome://tracing or https://ui.perfetto.dev)
+ */
+class SqlTrace {
+      public:
+	struct Span {
+		const char* name  = nullptr; //static string
+		qint64      start = 0;       //ns, steady clock
+		qint64      dur   = 0;       //ns
+		ulong       conn  = 0;       //mysql thread id, 0 if unknown
+		QByteArray  detail;
+	};
+
+	inline static uint maxSpansPerThread = 100000;
+	//the detail is cut at record time, so a huge statement is not pinned in memory by the trace
+	inline static int maxDetail = 512;
+
+	static void enable(bool on);
+	static bool isEnabled() {
+		return enabled.load(std::memory_order_relaxed);
+	}
+	static qint64 now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static void record(Span&& span);
+	//all the span collected so far, as {"traceEvents": [...]}, the buffer of the exited thread are dropped once exported
+	static QByteArray exportChrome();
+	static void       clear();
+
+      private:
+	inline static std::atomic<bool> enabled{false};
+};
+
+/**
+ * @brief The SqlSpan class times its own scope
+ */
+class SqlSpan {
+      public:
+	SqlSpan(const char* name, ulong conn = 0) {
+		if (SqlTrace::isEnabled()) {
+			span.name  = name;
+			span.conn  = conn;
+			span.start = SqlTrace::now();
+		}
+	}
+	~SqlSpan() {
+		end();
+	}
+	SqlSpan(const SqlSpan&) = delete;
+	SqlSpan& operator=(const SqlSpan&) = delete;
+
+	void setConn(ulong conn) {
+		span.conn = conn;
+	}
+	void setDetail(const QByteArray& detail) {
+		if (span.name) {
+			span.detail = detail.left(SqlTrace::maxDetail);
+		}
+	}
+	//close the span before the end of the scope
+	void end() {
+		if (span.name) {
+			span.dur = SqlTrace::now() - span.start;
+			SqlTrace::record(std::move(span));
+			span.name = nullptr;
+		}
+	}
+
+      private:
+	SqlTrace::Span span;
+};
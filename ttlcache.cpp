@@ -1,25 +1,36 @@
 #include "ttlcache.h"
+#include <QDebug>
 
 TTLCache::TTLCache(const DBConf& conf) {
 	setConf(conf);
 }
 
+TTLCache::~TTLCache() {
+	if (sweeper.joinable()) {
+		{
+			std::lock_guard<std::mutex> guard(sweeperMutex);
+			stopSweeper = true;
+		}
+		sweeperCv.notify_all();
+		sweeper.join();
+	}
+}
+
 void TTLCache::setConf(const DBConf& conf) {
 	db.setConf(conf);
 	//this will check if we have the proper table and column available in the selected DB
 	try {
-		auto row = db.queryLine("SELECT id, key, ttl FROM ttlcache ORDER BY id DESC LIMIT 1");
+		auto row = db.queryLine("SELECT `key`, payload, expireAt FROM ttlcache LIMIT 1");
 	} catch (QString e) {
 		QString msg = R"(
 The DB is probably missing the ttlcache table in the db %1, create it with
-CREATE TABLE `runnable` (
-	`id` int(10) unsigned NOT NULL AUTO_INCREMENT,
-	`operationCode` varchar(65000) CHARACTER SET ascii COLLATE ascii_bin NOT NULL,
-	`lastRun` int(10) unsigned NOT NULL,
-	`orario` datetime GENERATED ALWAYS AS (from_unixtime(`lastRun`)) VIRTUAL,
-	PRIMARY KEY (`id`),
-KEY `lastRun` (`lastRun`)
-) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+CREATE TABLE `ttlcache` (
+	`key` varbinary(255) NOT NULL,
+	`payload` longblob NOT NULL,
+	`expireAt` int(10) unsigned NOT NULL,
+	PRIMARY KEY (`key`),
+KEY `expireAt` (`expireAt`)
+) ENGINE=InnoDB;
 					  )";
 		msg         = msg.arg(QString(db.getConf().getDefaultDB()));
 		throw DBException(msg, DBException::Error::SchemaError);
@@ -27,13 +38,131 @@ KEY `lastRun` (`lastRun`)
 }
 
 QByteArray TTLCache::get(const QString& key) const {
-	(void)key;
-	return QByteArray();
+	if (auto hit = local.get(key); hit) {
+		return *hit;
+	}
+	auto res = getMany({key});
+	return res.value(key);
 }
 
 bool TTLCache::set(const QString& key, uint ttl, const QByteArray& payload) {
-	(void)key;
-	(void)ttl;
-	(void)payload;
+	return setMany({{key, payload}}, ttl);
+}
+
+void TTLCache::remove(const QString& key) {
+	local.remove(key);
+	db.query(QSL("DELETE FROM ttlcache WHERE `key` = %1").arg(base64this(key)));
+}
+
+QHash<QString, QByteArray> TTLCache::getMany(const QStringList& keys) const {
+	QHash<QString, QByteArray> found;
+	QStringList                missing;
+	for (auto& key : keys) {
+		if (auto hit = local.get(key); hit) {
+			found.insert(key, *hit);
+		} else {
+			missing.append(base64this(key));
+		}
+	}
+	if (missing.isEmpty()) {
+		return found;
+	}
+
+	auto now = QDateTime::currentSecsSinceEpoch();
+	auto sql = QSL("SELECT `key`, payload, expireAt FROM ttlcache WHERE `key` IN (%1) AND expireAt > %2")
+	               .arg(missing.join(','))
+	               .arg(now);
+	for (auto& row : db.query(sql)) {
+		auto key      = QString::fromUtf8(row.value(QBL("key")));
+		auto payload  = row.value(QBL("payload"));
+		auto expireAt = row.value(QBL("expireAt")).toLongLong();
+		found.insert(key, payload);
+		keepLocal(key, payload, expireAt);
+	}
+	return found;
+}
+
+bool TTLCache::setMany(const QHash<QString, QByteArray>& items, uint ttl) {
+	if (items.isEmpty()) {
+		return true;
+	}
+	auto expireAt = QDateTime::currentSecsSinceEpoch() + ttl;
+
+	static const QByteArray head  = "INSERT INTO ttlcache (`key`, payload, expireAt) VALUES\n";
+	static const QByteArray tail  = "\nON DUPLICATE KEY UPDATE payload = VALUES(payload), expireAt = VALUES(expireAt)";
+	auto                    limit = static_cast<int>(db.maxAllowedPacket() * 0.9) - head.size() - tail.size();
+
+	QByteArray values;
+	//kept locally only once stored, else this process would serve what nobody else can see
+	std::vector<QHash<QString, QByteArray>::const_iterator> inValues;
+	auto send = [&]() {
+		db.query(head + values + tail);
+		for (auto& item : inValues) {
+			keepLocal(item.key(), item.value(), expireAt);
+		}
+		values.clear();
+		inValues.clear();
+	};
+	for (auto iter = items.begin(); iter != items.end(); ++iter) {
+		auto row = QSL("(%1,%2,%3)").arg(base64this(iter.key()), base64this(iter.value())).arg(expireAt).toUtf8();
+		if (!values.isEmpty() && values.size() + row.size() + 2 > limit) {
+			send();
+		}
+		if (!values.isEmpty()) {
+			values.append(",\n");
+		}
+		values.append(row);
+		inValues.push_back(iter);
+	}
+	send();
 	return true;
 }
+
+void TTLCache::keepLocal(const QString& key, const QByteArray& payload, qint64 expireAt) const {
+	auto left = expireAt - QDateTime::currentSecsSinceEpoch();
+	if (left <= 0) {
+		return;
+	}
+	auto ttl = static_cast<uint>(std::min<qint64>(left, localTTL));
+	local.put(key, std::make_shared<const QByteArray>(payload), ttl, static_cast<quint64>(key.size() * 2 + payload.size()));
+}
+
+ShardedLRU<QString, QByteArray>::Stats TTLCache::getLocalStats() const {
+	return local.getStats();
+}
+
+void TTLCache::startSweeper(uint interval, uint chunk) {
+	if (sweeper.joinable()) {
+		return;
+	}
+	sweeper = std::thread([this, interval, chunk]() {
+		std::unique_lock<std::mutex> lock(sweeperMutex);
+		while (!stopSweeper) {
+			lock.unlock();
+			try {
+				sweep(chunk);
+			} catch (const QString& e) {
+				qWarning().noquote() << "ttlcache sweeper failed:" << e;
+			} catch (...) {
+				qWarning().noquote() << "ttlcache sweeper failed";
+			}
+			lock.lock();
+			sweeperCv.wait_for(lock, std::chrono::seconds(interval), [this] { return stopSweeper; });
+		}
+	});
+}
+
+void TTLCache::sweep(uint chunk) {
+	//small chunk, so the lock on the table is short and replication does not lag
+	auto sql = QSL("DELETE FROM ttlcache WHERE expireAt < %1 LIMIT %2").arg(QDateTime::currentSecsSinceEpoch()).arg(chunk);
+	while (true) {
+		db.query(sql);
+		if (static_cast<uint>(db.getAffectedRows()) < chunk) {
+			break;
+		}
+		std::unique_lock<std::mutex> lock(sweeperMutex);
+		if (sweeperCv.wait_for(lock, std::chrono::milliseconds(50), [this] { return stopSweeper; })) {
+			break;
+		}
+	}
+}
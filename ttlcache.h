@@ -1,22 +1,58 @@
 #ifndef TTLCACHE_H
 #define TTLCACHE_H
 
+#include "lrucache.h"
 #include "min_mysql.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief The TTLCache class is a key / value cache shared by all the process using the same DB (table ttlcache)
+ * with a bounded in process LRU in front, so a hot key does not even go to the DB.
+ * A value set by another node is seen once the local copy expire (at most localTTL)
+ */
 class TTLCache {
       public:
 	TTLCache(const DBConf& conf);
 	TTLCache() = default;
+	~TTLCache();
 
 	void setConf(const DBConf& conf);
 
+	//empty if missing or expired
 	QByteArray get(const QString& key) const;
 	bool       set(const QString& key, uint ttl, const QByteArray& payload);
+	void       remove(const QString& key);
+
+	//a single round trip for all the key (not found / expired are not in the result)
+	QHash<QString, QByteArray> getMany(const QStringList& keys) const;
+	//a single round trip (or more if bigger than the max packet)
+	bool setMany(const QHash<QString, QByteArray>& items, uint ttl);
+
+	//delete the expired row in chunk, every interval seconds, in a background thread
+	void startSweeper(uint interval = 60, uint chunk = 1000);
+
+	//local copy are kept at most this many second
+	uint localTTL = 60;
+	ShardedLRU<QString, QByteArray>::Stats getLocalStats() const;
+
 	//Non copyable
 	TTLCache& operator=(const TTLCache&) = delete;
 	TTLCache(const TTLCache&)            = delete;
 
       private:
+	void keepLocal(const QString& key, const QByteArray& payload, qint64 expireAt) const;
+	void sweep(uint chunk);
+
 	DB db;
+	//64MB
+	mutable ShardedLRU<QString, QByteArray> local{64 * 1024 * 1024};
+
+	std::thread             sweeper;
+	std::mutex              sweeperMutex;
+	std::condition_variable sweeperCv;
+	bool                    stopSweeper = false;
 };
 
 #endif // TTLCACHE_H